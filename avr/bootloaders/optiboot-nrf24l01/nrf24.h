@@ -71,7 +71,7 @@ static inline void nrf24_ce(uint8_t level) {
 #endif
 }
 
-static uint8_t nrf24_read_reg(uint8_t addr) {
+static RADIO_EXPORT uint8_t nrf24_read_reg(uint8_t addr) {
 	uint8_t ret;
 
 	nrf24_csn(0);
@@ -84,7 +84,7 @@ static uint8_t nrf24_read_reg(uint8_t addr) {
 	return ret;
 }
 
-static void nrf24_write_reg(uint8_t addr, uint8_t value) {
+static RADIO_EXPORT void nrf24_write_reg(uint8_t addr, uint8_t value) {
 	nrf24_csn(0);
 
 	spi_transfer(addr | W_REGISTER);
@@ -93,6 +93,57 @@ static void nrf24_write_reg(uint8_t addr, uint8_t value) {
 	nrf24_csn(1);
 }
 
+/*
+ * Driver state.  config and en_rxaddr are shadow copies of the registers
+ * that get rewritten on every Tx/Rx switch, nrf24_init() sets them to
+ * 0xff which has the reserved top bits set so it can never match a real
+ * value, forcing the first write after a reset (the chip keeps its
+ * registers across an MCU reset so we can't assume defaults).
+ *
+ * When the driver is exported to the application (RADIO_API) the state
+ * must not live in the bootloader's .bss, which is the application's RAM
+ * by then, so NRF24_STATE gives it a fixed address instead.
+ */
+struct nrf24_state {
+	uint8_t in_rx;
+	uint8_t config;
+	uint8_t en_rxaddr;
+	uint8_t rx_pending;
+	uint8_t rx_pipes;
+};
+
+#ifdef NRF24_STATE
+#define nrf24_st (*(struct nrf24_state *) (NRF24_STATE))
+#else
+static struct nrf24_state nrf24_st;
+#endif
+
+/* Skip the SPI transaction if the register already holds the value */
+static void nrf24_write_reg_cached(uint8_t addr, uint8_t value,
+		uint8_t *shadow) {
+	if (*shadow == value)
+		return;
+
+	*shadow = value;
+	nrf24_write_reg(addr, value);
+}
+
+#ifdef NRF24_STATE
+/*
+ * The register write the application gets.  It keeps the shadows in
+ * step, or the driver's next CONFIG or EN_RXADDR write could be skipped
+ * and leave the radio powered down.
+ */
+static RADIO_EXPORT void nrf24_write_reg_app(uint8_t addr, uint8_t value) {
+	if (addr == CONFIG)
+		nrf24_st.config = value;
+	else if (addr == EN_RXADDR)
+		nrf24_st.en_rxaddr = value;
+
+	nrf24_write_reg(addr, value);
+}
+#endif
+
 static uint8_t nrf24_read_status(void) {
 	uint8_t ret;
 
@@ -132,34 +183,69 @@ static void nrf24_delay(void) {
 	my_delay(5000);
 }
 
-/* Enable 16-bit CRC */
+/*
+ * Enable 16-bit CRC.  With an IRQ pin connected, RX_DR is left unmasked
+ * so that IRQ goes low when a packet arrives.
+ */
+#ifdef IRQ_PIN
+#define CONFIG_VAL ((1 << MASK_TX_DS) | \
+		(1 << MASK_MAX_RT) | (1 << CRCO) | (1 << EN_CRC))
+#else
 #define CONFIG_VAL ((1 << MASK_RX_DR) | (1 << MASK_TX_DS) | \
 		(1 << MASK_MAX_RT) | (1 << CRCO) | (1 << EN_CRC))
+#endif
+
+/* Some RF channel number, 0-125 (RF_CHANNEL= in the Makefile) */
+#ifndef NRF24_CHANNEL
+#define NRF24_CHANNEL 42
+#endif
+/* Data rate in kbps, 250, 1000 or 2000 (RF_RATE=) */
+#ifndef NRF24_RATE
+#define NRF24_RATE 250
+#endif
+#if NRF24_RATE == 250
+#define NRF24_RATE_BITS (1 << RF_DR_LOW)
+#elif NRF24_RATE == 1000
+#define NRF24_RATE_BITS 0
+#elif NRF24_RATE == 2000
+#define NRF24_RATE_BITS (1 << RF_DR_HIGH)
+#else
+#error NRF24_RATE must be 250, 1000 or 2000
+#endif
+#if NRF24_CHANNEL > 125
+#error NRF24_CHANNEL must be 0-125
+#endif
+/* Maximum Tx power */
+#define NRF24_RF_SETUP ((1 << RF_PWR_LOW) | (1 << RF_PWR_HIGH) | \
+		NRF24_RATE_BITS)
 
-static int nrf24_init(void) {
+/* nrf24_init() without the power-on delay, for a chip that's been up */
+static int nrf24_setup(void) {
 	/* CE and CSN are outputs */
 	CE_DDR |= CE_PIN;
 	CSN_DDR |= CSN_PIN;
 
 	nrf24_ce(0);
 	nrf24_csn(1);
-	nrf24_delay();
+
+	nrf24_st.in_rx = 0;
+	nrf24_st.config = 0xff;
+	nrf24_st.en_rxaddr = 0xff;
+	nrf24_st.rx_pending = 0;
+	nrf24_st.rx_pipes = 0x02;
 
 	/* 2ms interval, 15 retries (16 total) */
 	nrf24_write_reg(SETUP_RETR, 0x7f);
 	if (nrf24_read_reg(SETUP_RETR) != 0x7f)
 		return 1; /* There may be no nRF24 connected */
 
-	/* Maximum Tx power, 250kbps data rate */
-	nrf24_write_reg(RF_SETUP, (1 << RF_PWR_LOW) | (1 << RF_PWR_HIGH) |
-			(1 << RF_DR_LOW));
+	nrf24_write_reg(RF_SETUP, NRF24_RF_SETUP);
 	/* Dynamic payload length for TX & RX (pipes 0 and 1) */
 	nrf24_write_reg(DYNPD, 0x03);
 	nrf24_write_reg(FEATURE, 1 << EN_DPL);
 	/* Reset status bits */
 	nrf24_write_reg(STATUS, (1 << RX_DR) | (1 << TX_DS) | (1 << MAX_RT));
-	/* Set some RF channel number */
-	nrf24_write_reg(RF_CH, 42);
+	nrf24_write_reg(RF_CH, NRF24_CHANNEL);
 	/* 3-byte addresses */
 	nrf24_write_reg(SETUP_AW, 0x01);
 	/* Enable ACKing on both pipe 0 & 1 for TX & RX ACK support */
@@ -168,30 +254,54 @@ static int nrf24_init(void) {
 	return 0;
 }
 
-static void nrf24_set_rx_addr(uint8_t addr[3]) {
+static RADIO_EXPORT int nrf24_init(void) {
+	nrf24_delay();
+
+	return nrf24_setup();
+}
+
+static RADIO_EXPORT void nrf24_set_rx_addr(uint8_t addr[3]) {
 	nrf24_write_addr_reg(RX_ADDR_P1, addr);
 }
 
-static void nrf24_set_tx_addr(uint8_t addr[3]) {
+static RADIO_EXPORT void nrf24_set_tx_addr(uint8_t addr[3]) {
 	nrf24_write_addr_reg(TX_ADDR, addr);
 	/* The pipe 0 address is the address we listen on for ACKs */
 	nrf24_write_addr_reg(RX_ADDR_P0, addr);
 }
 
-static uint8_t nrf24_in_rx = 0;
+/*
+ * Receive on more pipes than just 1, e.g. to run several sessions at
+ * once on a gateway.  Bit n enables pipe n, pipe 0 stays reserved for
+ * ACKs, so that's 5 sessions at most (pipes 1-5).  Pipes 2-5 share addr[1] and addr[2] with pipe 1, only their
+ * first byte is set separately (RX_ADDR_P2 and up).  STATUS tells which
+ * pipe the packet at the head of the Rx FIFO came from.
+ */
+static RADIO_EXPORT void nrf24_set_rx_pipes(uint8_t pipes) {
+	pipes &= ~1;
+	nrf24_write_reg(DYNPD, pipes | 1);
+	nrf24_write_reg(EN_AA, pipes | 1);
+	nrf24_st.rx_pipes = pipes;
+
+	if (nrf24_st.in_rx)
+		nrf24_write_reg_cached(EN_RXADDR, pipes, &nrf24_st.en_rxaddr);
+}
 
-static void nrf24_rx_mode(void) {
-	if (nrf24_in_rx)
+static RADIO_EXPORT void nrf24_rx_mode(void) {
+	if (nrf24_st.in_rx)
 		return;
 
 	/* Rx mode */
-	nrf24_write_reg(CONFIG, CONFIG_VAL | (1 << PWR_UP) | (1 << PRIM_RX));
-	/* Only use data pipe 1 for receiving, pipe 0 is for TX ACKs */
-	nrf24_write_reg(EN_RXADDR, 0x02);
+	nrf24_write_reg_cached(CONFIG,
+			CONFIG_VAL | (1 << PWR_UP) | (1 << PRIM_RX),
+			&nrf24_st.config);
+	/* Data pipe 1 (and any set up by nrf24_set_rx_pipes()), 0 is for ACKs */
+	nrf24_write_reg_cached(EN_RXADDR, nrf24_st.rx_pipes,
+			&nrf24_st.en_rxaddr);
 
 	nrf24_ce(1);
 
-	nrf24_in_rx = 1;
+	nrf24_st.in_rx = 1;
 }
 
 /*
@@ -199,29 +309,43 @@ static void nrf24_rx_mode(void) {
  * Otherwise the chip is powered off.  In Standby a new operation will
  * start faster but more current is consumed while waiting.
  */
-static void nrf24_idle_mode(uint8_t standby) {
-	if (nrf24_in_rx) {
+static RADIO_EXPORT void nrf24_idle_mode(uint8_t standby) {
+	if (nrf24_st.in_rx) {
 		nrf24_ce(0);
 
 		if (!standby)
-			nrf24_write_reg(CONFIG, CONFIG_VAL);
+			nrf24_write_reg_cached(CONFIG, CONFIG_VAL,
+					&nrf24_st.config);
 	} else {
 		if (standby)
-			nrf24_write_reg(CONFIG, CONFIG_VAL | (1 << PWR_UP));
+			nrf24_write_reg_cached(CONFIG,
+					CONFIG_VAL | (1 << PWR_UP),
+					&nrf24_st.config);
 		else
-			nrf24_write_reg(CONFIG, CONFIG_VAL);
+			nrf24_write_reg_cached(CONFIG, CONFIG_VAL,
+					&nrf24_st.config);
 	}
 
-	nrf24_in_rx = 0;
+	nrf24_st.in_rx = 0;
 }
 
 static uint8_t nrf24_rx_new_data(void) {
 	return (nrf24_read_status() >> RX_DR) & 1;
 }
 
-static uint8_t nrf24_rx_fifo_data(void) {
+#ifdef IRQ_PIN
+/*
+ * RX_DR only fires on a new arrival, so nrf24_st.rx_pending remembers
+ * whether more packets were left in the FIFO after the last read.
+ */
+static RADIO_EXPORT uint8_t nrf24_rx_fifo_data(void) {
+	return nrf24_st.rx_pending || !(IRQ_INPUT & IRQ_PIN);
+}
+#else
+static RADIO_EXPORT uint8_t nrf24_rx_fifo_data(void) {
 	return !(nrf24_read_reg(FIFO_STATUS) & (1 << RX_EMPTY));
 }
+#endif
 
 static uint8_t nrf24_rx_data_avail(void) {
 	uint8_t ret;
@@ -236,39 +360,78 @@ static uint8_t nrf24_rx_data_avail(void) {
 	return ret;
 }
 
-static void nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len) {
-	uint8_t len;
-
+/*
+ * Start reading the packet at the head of the Rx FIFO, its payload
+ * (nrf24_rx_data_avail() bytes) can then be clocked in with
+ * spi_transfer(0) or nrf24_rx_burst() before calling nrf24_rx_end().
+ */
+static void nrf24_rx_begin(void) {
 	nrf24_write_reg(STATUS, 1 << RX_DR);
 
-	len = nrf24_rx_data_avail();
-	*pkt_len = len;
-
 	nrf24_csn(0);
 
 	spi_transfer(R_RX_PAYLOAD);
-	while (len --)
-		*buf ++ = spi_transfer(0);
+}
 
+static void nrf24_rx_end(void) {
 	nrf24_csn(1);
+
+#ifdef IRQ_PIN
+	/* RX_DR was cleared first so nothing arriving after this is missed */
+	nrf24_st.rx_pending = !(nrf24_read_reg(FIFO_STATUS) & (1 << RX_EMPTY));
+#endif
 }
 
-static void nrf24_tx(uint8_t *buf, uint8_t len) {
+/*
+ * Read len (at least 1) payload bytes into buf, starting the next SPI
+ * transfer before storing each byte.
+ */
+static void nrf24_rx_burst(uint8_t *buf, uint8_t len) {
+	uint8_t b;
+
+	SPDR = 0;
+	while (--len) {
+		while (!(SPSR & (1 << SPIF)));
+		b = SPDR;
+		SPDR = 0;
+		*buf++ = b;
+	}
+	while (!(SPSR & (1 << SPIF)));
+	*buf = SPDR;
+}
+
+static RADIO_EXPORT void nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len) {
+	uint8_t len;
+
+	len = nrf24_rx_data_avail();
+	*pkt_len = len;
+
+	nrf24_rx_begin();
+	while (len --)
+		*buf ++ = spi_transfer(0);
+	nrf24_rx_end();
+}
+
+static RADIO_EXPORT void nrf24_tx(uint8_t *buf, uint8_t len) {
 	/*
 	 * The user may have put the chip out of Rx mode to perform a
 	 * few Tx operations in a row, or they may have left the chip
 	 * in Rx which we'll switch back on when this Tx is done.
 	 */
-	if (nrf24_in_rx) {
+	if (nrf24_st.in_rx) {
 		nrf24_idle_mode(1);
 
-		nrf24_in_rx = 1;
+		nrf24_st.in_rx = 1;
 	}
 
-	/* Tx mode */
-	nrf24_write_reg(CONFIG, CONFIG_VAL | (1 << PWR_UP));
+	/*
+	 * Tx mode.  Back-to-back transmissions without an Rx period in
+	 * between find both registers already set up and skip the writes.
+	 */
+	nrf24_write_reg_cached(CONFIG, CONFIG_VAL | (1 << PWR_UP),
+			&nrf24_st.config);
 	/* Use pipe 0 for receiving ACK packets */
-	nrf24_write_reg(EN_RXADDR, 0x01);
+	nrf24_write_reg_cached(EN_RXADDR, 0x01, &nrf24_st.en_rxaddr);
 
 	/*
 	 * The TX_FULL bit is automatically reset on a successful Tx, but
@@ -299,7 +462,7 @@ static void nrf24_tx(uint8_t *buf, uint8_t len) {
 	nrf24_ce(1);
 }
 
-static int nrf24_tx_result_wait(void) {
+static RADIO_EXPORT int nrf24_tx_result_wait(void) {
 	uint8_t status;
 	uint16_t count = 10000; /* ~100ms timeout */
 
@@ -317,8 +480,8 @@ static int nrf24_tx_result_wait(void) {
 	/* Reset status bits */
 	nrf24_write_reg(STATUS, (1 << MAX_RT) | (1 << TX_DS));
 
-	if (nrf24_in_rx) {
-		nrf24_in_rx = 0;
+	if (nrf24_st.in_rx) {
+		nrf24_st.in_rx = 0;
 
 		nrf24_rx_mode();
 	}
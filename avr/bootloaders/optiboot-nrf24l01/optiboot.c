@@ -119,8 +119,10 @@
 /* used by Arduino, so off by default.                    */
 /*                                                        */
 /* TIMEOUT_MS:                                            */
-/* Bootloader timeout period, in milliseconds.            */
-/* 500,1000,2000,4000,8000 supported.                     */
+/* How long to wait for a programmer after reset, in      */
+/* milliseconds, 16 to 8000 (rounded up to 16, 32, 64,    */
+/* 125, 250, 500, 1000, ...).  Once it has sent           */
+/* STK_GET_SYNC the usual 1s timeout applies.             */
 /*                                                        */
 /* UART:                                                  */
 /* UART number (0..n) for devices with more than          */
@@ -133,6 +135,97 @@
 /* mode for simplicity. Slave address will be read from   */
 /* the EEPROM, needs to be set up first.                  */
 /*                                                        */
+/* STAGED_UPDATE:                                         */
+/* On parts with 64kB or more, let the application write  */
+/* a new image into the upper half of flash through the   */
+/* jump table (see optiboot.h) and describe it in EEPROM. */
+/* On the next reset the bootloader checks its CRC-32 and */
+/* copies it over the application in one pass.            */
+/*                                                        */
+/* SPI_FLASH:                                             */
+/* Like STAGED_UPDATE, but for small parts: the image is  */
+/* staged by the app in an external SPI NOR flash on the  */
+/* same bus as the radio, chip select FLASH_CS.           */
+/*                                                        */
+/* RF_CE, RF_CSN, RF_IRQ:                                 */
+/* nRF24L01+ pins, named like LED (eg. RF_CE=D7).  The    */
+/* defaults depend on the chip, see pin_defs.h.  RF_IRQ   */
+/* is optional and saves SPI polling while idle.          */
+/*                                                        */
+/* RF_CHANNEL, RF_RATE:                                   */
+/* nRF24L01+ channel (0-125, default 42) and data rate in */
+/* kbps (250, 1000 or 2000, default 250).  Must match the */
+/* flasher; different channels let several flashers work  */
+/* side by side.                                          */
+/*                                                        */
+/* CHIP_ERASE:                                            */
+/* Implement STK_CHIP_ERASE (avrdude -e) by erasing the   */
+/* application pages that aren't blank yet, and skip the  */
+/* erase when programming a page that's already blank.    */
+/*                                                        */
+/* IMAGE_CRC:                                             */
+/* Check the CRC-32 of an image declared by the host      */
+/* (STK_SET_IMAGE) before starting it the first time,     */
+/* and stay in the bootloader if it doesn't match.        */
+/*                                                        */
+/* RESUME:                                                */
+/* Keep a journal of the pages written in EEPROM so that  */
+/* an interrupted upload can be continued where it left   */
+/* off (STK_RESUME, see stk500.h).                        */
+/*                                                        */
+/* RADIO_HANDOFF:                                         */
+/* Leave the radio configured and in Standby when the     */
+/* bootloader times out and describe it to the app (R3    */
+/* and the top of RAM) so it can skip nrf24_init().       */
+/*                                                        */
+/* RADIO_ENTER:                                           */
+/* Let a running app request a radio upload: it stores a  */
+/* marker and the flasher's address at the top of RAM     */
+/* and resets through the watchdog.  The bootloader then  */
+/* skips the LED flashes and radio power-up delay, sends  */
+/* to that address straight away and waits up to 8s.      */
+/*                                                        */
+/* PAGE_AT:                                               */
+/* STK_PROG_PAGE_AT (stk500.h): load address and write    */
+/* one or more whole flash pages in a single command.     */
+/* 0 pages or pages reaching the bootloader: STK_NOSYNC.  */
+/*                                                        */
+/* QUIET:                                                 */
+/* Optimistic replies: after STK_SET_QUIET n (stk500.h)   */
+/* LOAD_ADDRESS, PROG_PAGE and SET_DEVICE(_EXT) are only  */
+/* answered every n-th time, acknowledging all of them.   */
+/* A command out of sync gets STK_NOSYNC instead.         */
+/*                                                        */
+/* BEACON:                                                */
+/* After radio_init() send one packet with our address,   */
+/* signature, version and image CRC to BEACON_ADDR        */
+/* ("BCN" by default) so that a gateway can take stock of */
+/* the nodes in the bootloader.  Needs RADIO_UART.        */
+/*                                                        */
+/* RADIO_FLOW:                                            */
+/* Move received packets from the nRF24 into a RAM ring   */
+/* before and during flash writes, so that the flasher    */
+/* isn't left without ACKs while the CPU is halted by     */
+/* NRWW page writes.  Needs RADIO_UART.                   */
+/*                                                        */
+/* LOW_POWER:                                             */
+/* Battery nodes: listen in 5ms Rx windows every ~70ms    */
+/* for TIMEOUT_MS, sleeping in Power-down in between,     */
+/* instead of keeping the radio in Rx.  Needs RADIO_UART  */
+/* and a flasher that repeats its first packet.           */
+/*                                                        */
+/* RADIO_API:                                             */
+/* Export spi_* and nrf24_* through the jump table so     */
+/* the application can use the bootloader's radio driver  */
+/* instead of linking its own, see optiboot.h.  Needs     */
+/* RADIO_UART.                                            */
+/*                                                        */
+/* SEQN:                                                  */
+/* Prefix every radio packet with a sequence number so    */
+/* that retransmitted packets are dropped.  On by default */
+/* with RADIO_UART, SEQN=0 saves a few bytes but must     */
+/* match the flasher.                                     */
+/*                                                        */
 /**********************************************************/
 
 /**********************************************************/
@@ -209,7 +302,7 @@
 asm("  .section .version\n"
     "optiboot_version:  .word " MAKEVER(OPTIBOOT_MAJVER, OPTIBOOT_MINVER) "\n"
     "  .section .text\n");
-
+
 #include <inttypes.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
@@ -224,6 +317,15 @@ asm("  .section .version\n"
 
 #include "pin_defs.h"
 #include "stk500.h"
+#if defined(RADIO_UART) || defined(SPI_FLASH)
+#ifdef RADIO_API
+/* Called through the jump table, keep a copy even where it gets inlined */
+#define RADIO_EXPORT __attribute__ ((used))
+#else
+#define RADIO_EXPORT
+#endif
+#include "spi.h"
+#endif
 
 #ifndef LED_START_FLASHES
 #define LED_START_FLASHES 0
@@ -301,6 +403,43 @@ asm("  .section .version\n"
 #define WATCHDOG_8S     (_BV(WDP3) | _BV(WDP0) | _BV(WDE))
 #endif
 
+/*
+ * TIMEOUT_MS is the window after reset in which a programmer has to show
+ * up, rounded up to a watchdog period.  Once it has (STK_GET_SYNC) the
+ * session timeout applies, 1s between commands as before.
+ */
+#define WATCHDOG_SESSION WATCHDOG_1S
+#ifndef TIMEOUT_MS
+#define WATCHDOG_BOOT   WATCHDOG_SESSION
+#elif TIMEOUT_MS <= 16
+#define WATCHDOG_BOOT   WATCHDOG_16MS
+#elif TIMEOUT_MS <= 32
+#define WATCHDOG_BOOT   WATCHDOG_32MS
+#elif TIMEOUT_MS <= 64
+#define WATCHDOG_BOOT   WATCHDOG_64MS
+#elif TIMEOUT_MS <= 125
+#define WATCHDOG_BOOT   WATCHDOG_125MS
+#elif TIMEOUT_MS <= 250
+#define WATCHDOG_BOOT   WATCHDOG_250MS
+#elif TIMEOUT_MS <= 500
+#define WATCHDOG_BOOT   WATCHDOG_500MS
+#elif TIMEOUT_MS <= 1000
+#define WATCHDOG_BOOT   WATCHDOG_1S
+#elif TIMEOUT_MS <= 2000
+#define WATCHDOG_BOOT   WATCHDOG_2S
+#elif !defined(WATCHDOG_4S)
+#error TIMEOUT_MS over 2000 is not supported on this chip
+#elif TIMEOUT_MS <= 4000
+#define WATCHDOG_BOOT   WATCHDOG_4S
+#else
+#define WATCHDOG_BOOT   WATCHDOG_8S
+#endif
+
+/* flash_led() only resets the watchdog every 62.5ms or so */
+#if defined(TIMEOUT_MS) && TIMEOUT_MS <= 64 && LED_START_FLASHES > 0
+#error TIMEOUT_MS of 64 or less needs LED_START_FLASHES=0
+#endif
+
 /* Function Prototypes */
 /* The main function is in init9, which removes the interrupt vector table */
 /* we don't need. It is also 'naked', which means the compiler does not    */
@@ -308,6 +447,7 @@ asm("  .section .version\n"
 int main(void) __attribute__ ((OS_main)) __attribute__ ((section (".init9"))) __attribute__ ((__noreturn__));
 void putch(char);
 uint8_t getch(void);
+static void getbuf(uint8_t *, uint8_t);
 static inline void getNch(uint8_t); /* "static inline" is a compiler hint to reduce code size */
 void verifySpace();
 static inline void flash_led(uint8_t);
@@ -322,18 +462,89 @@ void appStart(uint8_t rstFlags) __attribute__ ((naked))  __attribute__ ((__noret
 #ifdef RADIO_UART
 static void radio_init(void);
 #endif
+#if defined(BEACON) && !defined(RADIO_UART)
+#error BEACON needs RADIO_UART
+#endif
+#ifdef LOW_POWER
+#ifndef RADIO_UART
+#error LOW_POWER needs RADIO_UART
+#endif
+static void radio_listen(void);
+#endif
+#ifdef RADIO_FLOW
+#ifndef RADIO_UART
+#error RADIO_FLOW needs RADIO_UART
+#endif
+static void radio_drain(void);
+/* Keep emptying the radio's Rx FIFO while waiting for SPM */
+#define spm_busy_wait() do radio_drain(); while (boot_spm_busy())
+#else
+#define spm_busy_wait() boot_spm_busy_wait()
+#endif
+
+#ifdef RADIO_HANDOFF
+#ifndef RADIO_UART
+#error RADIO_HANDOFF needs RADIO_UART
+#endif
+/*
+ * Radio settings left for the application, just below reset_cause at
+ * the top of RAM.  wait_timeout() sets magic,
+ * appStart() passes it in R3 and clears it.  See optiboot.h.
+ */
+struct radio_handoff {
+  uint8_t magic;
+  uint8_t present;
+  uint8_t channel;
+  uint8_t rf_setup;
+  uint8_t addr[3];
+};
+#define handoff (*(struct radio_handoff *) (RAMEND - 27))
+#define HANDOFF_MAGIC 0x5a
+#endif
+
+#ifdef RADIO_ENTER
+#ifndef RADIO_UART
+#error RADIO_ENTER needs RADIO_UART
+#endif
+/*
+ * Set by the application just before a watchdog reset to ask for a radio
+ * session with the flasher at peer.  Only trusted after a watchdog reset
+ * and cleared once used.  See optiboot.h.
+ */
+struct enter_request {
+  uint16_t magic;
+  uint8_t peer[3];
+};
+#define enter_req (*(struct enter_request *) (RAMEND - 15))
+#define ENTER_MAGIC 0xb007
+#define entered_by_app() (enter_req.magic == ENTER_MAGIC)
+#ifdef WATCHDOG_8S
+#define WATCHDOG_ENTER WATCHDOG_8S
+#else
+#define WATCHDOG_ENTER WATCHDOG_2S
+#endif
+#endif
+
+#ifdef QUIET
+/*
+ * Optimistic replies, set up by STK_SET_QUIET.  Write commands are only
+ * answered every quiet_every commands, quiet_now suppresses STK_INSYNC
+ * and STK_OK for the current one.
+ */
+static uint8_t quiet_every, quiet_count, quiet_now;
+#endif
 
 /*
  * NRWW memory
  * Addresses below NRWW (Non-Read-While-Write) can be programmed while
  * continuing to run code from flash, slightly speeding up programming
  * time.  Beware that Atmel data sheets specify this as a WORD address,
- * while optiboot will be comparing against a 16-bit byte address.  This
- * means that on a part with 128kB of memory, the upper part of the lower
- * 64k will get NRWW processing as well, even though it doesn't need it.
- * That's OK.  In fact, you can disable the overlapping processing for
- * a part entirely by setting NRWWSTART to zero.  This reduces code
- * space a bit, at the expense of being slightly slower, overall.
+ * while optiboot will be comparing against a 16-bit byte address.  On
+ * parts over 64kB that address is within the top 64k bank, in_nrww()
+ * also checks RAMPZ so the same offset in the lower banks still gets
+ * the overlapped erase.  On the smaller parts you can disable the
+ * overlapping processing entirely by setting NRWWSTART to zero.  This
+ * reduces code space a bit, at the expense of being slightly slower.
  *
  * RAMSTART should be self-explanatory.  It's bigger on parts with a
  * lot of peripheral registers.
@@ -356,7 +567,7 @@ static void radio_init(void);
 #elif defined(__AVR_ATtiny84__)
 #define RAMSTART (0x100)
 #define NRWWSTART (0x0000)
-#elif defined(__AVR_ATmega1280__)
+#elif defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
 #define RAMSTART (0x200)
 #define NRWWSTART (0xE000)
 #elif defined(__AVR_ATmega8__) || defined(__AVR_ATmega88__)
@@ -364,8 +575,17 @@ static void radio_init(void);
 #define NRWWSTART (0x1800)
 #endif
 
+#if FLASHEND > 0xffff
+#define in_nrww(a) ((a) >= NRWWSTART && RAMPZ == (FLASHEND >> 16))
+#else
+#define in_nrww(a) ((a) >= NRWWSTART)
+#endif
+
 // TODO: get actual .bss+.data size from GCC
-#ifdef RADIO_UART
+#ifdef RADIO_FLOW
+#define BSS_SIZE	0x100
+#elif defined(RADIO_UART) || defined(RESUME) || defined(IMAGE_CRC) || \
+    defined(QUIET)
 #define BSS_SIZE	0x80
 #else
 #define BSS_SIZE	0
@@ -420,24 +640,601 @@ static void radio_init(void);
 # define UART_UDR UDR3
 #endif
 
-static void eeprom_write(uint16_t addr, uint8_t val) {
+static uint8_t eeprom_read(uint16_t addr) {
   while (!eeprom_is_ready());
 
   EEAR = addr;
+  EECR |= 1 << EERE;	/* Start eeprom read by writing EERE */
+
+  return EEDR;
+}
+
+/*
+ * Only bytes that change are written.  Where the chip has programming
+ * modes, a byte going to 0xff is only erased and a byte that only loses
+ * bits is only written, each taking half the time of erase + write.
+ * Doesn't wait for the write to finish.
+ */
+static void eeprom_write(uint16_t addr, uint8_t val) {
+  uint8_t old = eeprom_read(addr);
+
+  if (old == val)
+    return;
+
   EEDR = val;
+#ifdef EEPM0
+  if (val == 0xff)
+    EECR = 1 << EEPM0;	/* Erase only */
+  else if ((old & val) == val)
+    EECR = 1 << EEPM1;	/* Write only */
+  else
+    EECR = 0;		/* Erase and write */
+#endif
   EECR |= 1 << EEMPE;	/* Write logical one to EEMPE */
   EECR |= 1 << EEPE;	/* Start eeprom write by setting EEPE */
 }
 
-static uint8_t eeprom_read(uint16_t addr) {
+#ifdef SPI_FLASH
+#define STAGED_UPDATE
+#endif
+
+#if defined(STAGED_UPDATE) || defined(IMAGE_CRC)
+/* Standard (zlib) CRC-32, bitwise to keep it small */
+static uint32_t crc32_update(uint32_t crc, uint8_t data) {
+  uint8_t i;
+
+  crc ^= data;
+  for (i = 8; i; i--)
+    crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+
+  return crc;
+}
+
+static uint32_t eeprom_read_long(uint16_t addr) {
+  uint32_t val = 0;
+  uint8_t i = 4;
+
+  do
+    val = (val << 8) | eeprom_read(addr + --i);
+  while (i);
+
+  return val;
+}
+
+#ifdef RAMPZ
+#define flash_read_far(a) pgm_read_byte_far(a)
+#else
+#define flash_read_far(a) pgm_read_byte_near(a)
+#endif
+#endif
+
+#ifdef IMAGE_CRC
+#ifdef VIRTUAL_BOOT_PARTITION
+#error IMAGE_CRC can not check the patched vectors of VIRTUAL_BOOT_PARTITION
+#endif
+/*
+ * Application image check.  The host declares the image it uploads with
+ * STK_SET_IMAGE (length in pages and CRC-32) and the bootloader keeps it
+ * in EEPROM with a status byte:
+ *   'P' declared, not checked yet
+ *   'V' checked and good
+ *   'B' checked and bad, the application is never started
+ *   anything else: unknown, the application is started as before
+ * The check runs once, on the first start after the upload.  Writing
+ * flash without declaring the image first resets the status to unknown.
+ */
+/* Status, pages (16), CRC (32), OPTIBOOT_EE_IMAGE in optiboot.h */
+#define EE_IMAGE	(E2END - 20)
+
+static uint8_t image_declared;
+
+static void image_touch(void) {
+  if (!image_declared)
+    eeprom_write(EE_IMAGE, 0xff);
+}
+
+/* Whether the application may be started */
+static uint8_t image_ok(void) {
+  uint8_t status = eeprom_read(EE_IMAGE);
+
+  if (status == 'P') {
+    uint32_t addr, crc = 0xffffffff;
+    uint32_t len = (uint32_t) SPM_PAGESIZE *
+      (eeprom_read(EE_IMAGE + 1) | (eeprom_read(EE_IMAGE + 2) << 8));
+
+    for (addr = 0; addr < len; addr++) {
+      crc = crc32_update(crc, flash_read_far(addr));
+      watchdogReset();
+    }
+
+    status = ~crc == eeprom_read_long(EE_IMAGE + 3) ? 'V' : 'B';
+    eeprom_write(EE_IMAGE, status);
+  }
+
+  return status != 'B';
+}
+#endif
+
+#ifdef STAGED_UPDATE
+/*
+ * Staged update.  A complete image is put somewhere by the application
+ * and described by 8 bytes at the end of EEPROM:
+ *   'S', 'U', length in pages (16 bit), CRC-32 of those pages (32 bit)
+ * all little endian.  See optiboot.h.
+ */
+#define EE_STAGE	(E2END - 7)
+
+#ifdef SPI_FLASH
+#if FLASHEND > 0xffff
+#error SPI_FLASH is for parts too small for STAGED_UPDATE, use that instead
+#endif
+
+/*
+ * The image is staged in a W25Qxx-style SPI NOR flash sharing the bus
+ * with the radio, at SPI_FLASH_OFFSET, and is streamed out with a single
+ * READ command.  It can only replace the RWW section.
+ */
+#ifndef SPI_FLASH_OFFSET
+#define SPI_FLASH_OFFSET 0
+#endif
+#define STAGE_SIZE	((uint32_t) NRWWSTART)
+
+#define SPI_FLASH_READ		0x03
+#define SPI_FLASH_WAKEUP	0xab
+
+static inline void flash_cs(uint8_t level) {
+  if (level)
+    FLASH_CS_PORT |= FLASH_CS_PIN;
+  else
+    FLASH_CS_PORT &= ~FLASH_CS_PIN;
+}
+
+static void stage_begin(void) {
+  uint8_t i = F_CPU / 1000000L;
+
+#ifdef RADIO_UART
+  // Keep the nRF24 off the bus
+  CSN_PORT |= CSN_PIN;
+  CSN_DDR |= CSN_PIN;
+#endif
+  FLASH_CS_PORT |= FLASH_CS_PIN;
+  FLASH_CS_DDR |= FLASH_CS_PIN;
+  spi_init();
+
+  // The app may have left it in deep power-down (tRES1 is 3us max)
+  flash_cs(0);
+  spi_transfer(SPI_FLASH_WAKEUP);
+  flash_cs(1);
+  do
+    watchdogReset();
+  while (--i);
+
+  flash_cs(0);
+  spi_transfer(SPI_FLASH_READ);
+  spi_transfer((uint32_t) SPI_FLASH_OFFSET >> 16);
+  spi_transfer(SPI_FLASH_OFFSET >> 8);
+  spi_transfer(SPI_FLASH_OFFSET);
+}
+
+#define stage_next()	spi_transfer(0)
+#define stage_end()	flash_cs(1)
+#else
+#if FLASHEND < 0xffff
+#error STAGED_UPDATE needs a part with at least 64kB of flash
+#endif
+
+/*
+ * The image is staged in the upper half of flash, up to the NRWW
+ * section, by the application calling stage_write_page().
+ */
+#define STAGE_START	((uint32_t) (FLASHEND + 1) / 2)
+#define STAGE_END	((uint32_t) FLASHEND + 1 - 0x2000)
+#define STAGE_SIZE	(STAGE_END - STAGE_START)
+
+static uint32_t stage_ptr;
+
+#define stage_begin()	(stage_ptr = STAGE_START)
+#define stage_next()	flash_read_far(stage_ptr++)
+#define stage_end()
+
+/*
+ * Called by the application through the jump table, with interrupts in
+ * whatever state the app left them.  Only whole pages inside the staging
+ * area can be written so a running app can't damage itself or us.
+ * Returns 0 on success, 1 for a bad address, 2 when the page doesn't
+ * read back as written.
+ */
+uint8_t stage_write_page(uint32_t addr, const uint8_t *buf) __attribute__ ((used));
+uint8_t stage_write_page(uint32_t addr, const uint8_t *buf) {
+  uint8_t sreg, i;
+
+  if (addr < STAGE_START || addr >= STAGE_END || (addr & (SPM_PAGESIZE - 1)))
+    return 1;
+
+  // SPM is blocked while an EEPROM write (eg. the record) is still going
   while (!eeprom_is_ready());
 
-  EEAR = addr;
-  EECR |= 1 << EERE;	/* Start eeprom read by writing EERE */
+  // The app's vectors are in the RWW section, unreadable during SPM
+  sreg = SREG;
+  asm volatile ("cli");
 
-  return EEDR;
+  boot_page_erase(addr);
+  boot_spm_busy_wait();
+
+  i = SPM_PAGESIZE / 2;
+  do {
+    boot_page_fill(addr, buf[0] | (buf[1] << 8));
+    buf += 2;
+    addr += 2;
+  } while (--i);
+
+  addr -= SPM_PAGESIZE;
+  boot_page_write(addr);
+  boot_spm_busy_wait();
+  boot_rww_enable();
+
+  SREG = sreg;
+
+  buf -= SPM_PAGESIZE;
+  i = 0;
+  do
+    if (flash_read_far(addr + i) != buf[i])
+      return 2;
+  while (++i != (uint8_t) SPM_PAGESIZE);
+  return 0;
+}
+#endif
+
+/*
+ * Copy a valid staged image over the application.  The staged copy stays
+ * untouched until the EEPROM record is cleared at the end, so a reset in
+ * the middle just restarts the copy.  After a successful copy the record
+ * is marked installed ('I') rather than cleared, see optiboot.h.
+ */
+static void stage_install(void) {
+  uint32_t addr, crc = 0xffffffff;
+  uint16_t pages;
+  uint8_t status = 0xff;
+
+  if (eeprom_read(EE_STAGE) != 'S' || eeprom_read(EE_STAGE + 1) != 'U')
+    return;
+
+  // A watchdog reset leaves the WDT running at 16ms
+  watchdogConfig(WATCHDOG_1S);
+
+  pages = eeprom_read(EE_STAGE + 2) | (eeprom_read(EE_STAGE + 3) << 8);
+  if (!pages || pages > STAGE_SIZE / SPM_PAGESIZE)
+    goto done;
+
+  stage_begin();
+  for (addr = 0; addr < (uint32_t) pages * SPM_PAGESIZE; addr++) {
+    crc = crc32_update(crc, stage_next());
+    watchdogReset();
+  }
+  stage_end();
+  if (~crc != eeprom_read_long(EE_STAGE + 4))
+    goto done;
+
+  stage_begin();
+  for (addr = 0; pages--; addr += SPM_PAGESIZE) {
+    uint16_t i;
+
+    boot_page_erase(addr);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+
+    for (i = 0; i < SPM_PAGESIZE; i += 2) {
+      uint16_t w;
+
+      w = stage_next();
+      w |= stage_next() << 8;
+      boot_page_fill(addr + i, w);
+    }
+
+    boot_page_write(addr);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+    watchdogReset();
+  }
+  stage_end();
+#ifdef IMAGE_CRC
+  // Checked already, whatever was declared before is gone
+  eeprom_write(EE_IMAGE, 0xff);
+#endif
+  // Length and CRC stay valid for the staged copy, a relay can serve it
+  status = 'I';
+
+done:
+  eeprom_write(EE_STAGE, status);
+#ifdef RAMPZ
+  RAMPZ = 0;
+#endif
+}
+#endif
+
+#ifdef RESUME
+/*
+ * Upload journal.  The host names the image it's about to write with
+ * STK_RESUME, from then on each flash page written in order from page 0
+ * bumps the committed page count kept in EEPROM next to the image id.
+ * When the link drops the host reconnects, sends STK_RESUME with the
+ * same id and continues from the page count it gets back.  A page
+ * written without STK_RESUME first resets the count.
+ *
+ * To spare the EEPROM cell (and the 3.4ms write before the next erase)
+ * the count only goes to EEPROM every JOURNAL_EVERY pages, and exactly
+ * when the session ends through STK_LEAVE_PROGMODE or wait_timeout().
+ * A session that ends in a watchdog reset redoes at most
+ * JOURNAL_EVERY - 1 pages.
+ */
+#define EE_JOURNAL (E2END - 13)	/* id (32 bit), pages (16 bit) */
+#ifndef JOURNAL_EVERY
+#define JOURNAL_EVERY 16
+#endif
+
+static uint8_t journal_state;	/* 0: untouched, 1: tracking, 2: reset */
+static uint16_t journal_pages;
+
+static void journal_save(void) {
+  eeprom_write(EE_JOURNAL + 4, journal_pages);
+  eeprom_write(EE_JOURNAL + 5, journal_pages >> 8);
+}
+
+static void journal_set_pages(uint16_t pages) {
+  journal_pages = pages;
+  journal_save();
+}
+
+/* Record the exact count before the session ends */
+static void journal_flush(void) {
+  if (journal_state == 1) {
+    journal_save();
+    while (!eeprom_is_ready());
+  }
+}
+
+static uint16_t journal_resume(uint8_t *id) {
+  uint8_t i;
+
+  journal_pages = eeprom_read(EE_JOURNAL + 4) |
+    (eeprom_read(EE_JOURNAL + 5) << 8);
+  for (i = 0; i < 4; i++)
+    if (eeprom_read(EE_JOURNAL + i) != id[i]) {
+      // Another image, the count goes first so it never belongs to it
+      if (journal_pages)
+        journal_set_pages(0);
+      eeprom_write(EE_JOURNAL + i, id[i]);
+    }
+  journal_state = 1;
+
+  return journal_pages;
+}
+
+/* Called with each flash page once it's been written */
+static void journal_page(uint16_t page) {
+  if (!journal_state) {
+    journal_state = 2;
+    journal_set_pages(0);
+  } else if (journal_state == 1 && page == journal_pages) {
+    journal_pages = page + 1;
+    if (!(journal_pages % JOURNAL_EVERY))
+      journal_save();
+  }
+}
+
+#ifdef RAMPZ
+#define page_number(a) ((uint16_t) ((((uint32_t) RAMPZ << 16) | (a)) / SPM_PAGESIZE))
+#else
+#define page_number(a) ((a) / SPM_PAGESIZE)
+#endif
+#endif
+
+#ifdef CHIP_ERASE
+/* Whether the flash page at address (in the current RAMPZ bank) is blank */
+static uint8_t page_blank(uint16_t address) {
+  uint8_t count = (uint8_t) SPM_PAGESIZE, ch;
+
+  do {
+#ifdef RAMPZ
+    __asm__ ("elpm %0,Z\n" : "=r" (ch) : "z" (address));
+#else
+    __asm__ ("lpm %0,Z\n" : "=r" (ch) : "z" (address));
+#endif
+    if (ch != 0xff)
+      return 0;
+    address++;
+  } while (--count);
+
+  return 1;
+}
+
+/*
+ * Erase the application area, everything below main() which is where the
+ * bootloader starts, leaving pages that are already blank alone.  Page
+ * writes that follow then skip their own erase.
+ */
+static void chip_erase(void) {
+#ifdef RAMPZ
+  uint32_t addr, end;
+  uint8_t rampz = RAMPZ;
+
+  __asm__ ("ldi %A0,lo8(main)\n"
+           "ldi %B0,hi8(main)\n"
+           "ldi %C0,hlo8(main)\n"
+           "ldi %D0,0\n" : "=d" (end));
+#else
+  uint16_t addr, end;
+
+  __asm__ ("ldi %A0,lo8(main)\n"
+           "ldi %B0,hi8(main)\n" : "=d" (end));
+#endif
+
+#ifdef IMAGE_CRC
+  image_touch();
+  while (!eeprom_is_ready());
+#endif
+
+  for (addr = 0; addr < end; addr += SPM_PAGESIZE) {
+    watchdogReset();
+#ifdef RAMPZ
+    RAMPZ = addr >> 16;
+#endif
+    if (page_blank(addr))
+      continue;
+    boot_page_erase(addr);
+    boot_spm_busy_wait();
+  }
+#if defined(RWWSRE)
+  boot_rww_enable();
+#endif
+#ifdef RAMPZ
+  RAMPZ = rampz;
+#endif
+#ifdef RESUME
+  journal_set_pages(0);
+#endif
+}
+#endif
+
+#ifdef PAGE_AT
+/*
+ * Byte address the bootloader starts at: main() comes first in .text
+ * (.init9, no startup files).  STK_PROG_PAGE_AT must stay below it.
+ */
+static uint32_t boot_start(void) {
+  uint32_t a;
+
+  asm ("ldi %A0, lo8(main)\n"
+       "\tldi %B0, hi8(main)\n"
+       "\tldi %C0, hlo8(main)\n"
+       "\tldi %D0, 0\n" : "=d" (a));
+  return a;
+}
+#endif
+
+/*
+ * Receive a flash page, or length bytes of it (0 means 256), and program
+ * it at address.  With eop the command terminator is read and the reply
+ * started as soon as the data is in, otherwise the data for another page
+ * follows (STK_PROG_PAGE_AT).
+ */
+static void prog_flash(uint16_t address, uint8_t length, uint8_t eop) {
+  uint8_t *bufPtr;
+  uint16_t addrPtr;
+  uint8_t ch;
+
+#ifdef IMAGE_CRC
+  image_touch();
+#endif
+#if defined(RESUME) || defined(SUPPORT_EEPROM) || defined(IMAGE_CRC)
+  // SPM is blocked while an EEPROM write is still going
+  while (!eeprom_is_ready());
+#endif
+
+  // If we are in RWW section, immediately start page erase
+#ifdef CHIP_ERASE
+  // Blank pages (eg. after a chip erase) don't need erasing
+  if (!in_nrww(address) && !page_blank(address))
+#else
+  if (!in_nrww(address))
+#endif
+    __boot_page_erase_short((uint16_t)(void*)address);
+
+  // While that is going on, read in page contents
+  getbuf(buff, length);
+
+  // If we are in NRWW section, page erase has to be delayed until now.
+#ifdef CHIP_ERASE
+  if (in_nrww(address) && !page_blank(address)) {
+#else
+  if (in_nrww(address)) {
+#endif
+#ifdef RADIO_FLOW
+    // The CPU stops until the erase is done, make room in the Rx FIFO
+    radio_drain();
+#endif
+    __boot_page_erase_short((uint16_t)(void*)address);
+  }
+
+  // Read command terminator, start reply
+  if (eop)
+    verifySpace();
+
+  // If only a partial page is to be programmed, the erase might not be complete.
+  // So check that here
+  spm_busy_wait();
+
+#ifdef VIRTUAL_BOOT_PARTITION
+  if ((uint16_t)(void*)address == 0) {
+    // This is the reset vector page. We need to live-patch the code so the
+    // bootloader runs.
+    //
+    // Move RESET vector to WDT vector
+    uint16_t vect = buff[0] | (buff[1]<<8);
+    rstVect = vect;
+    wdtVect = buff[8] | (buff[9]<<8);
+    vect -= 4; // Instruction is a relative jump (rjmp), so recalculate.
+    buff[8] = vect & 0xff;
+    buff[9] = vect >> 8;
+
+    // Add jump to bootloader at RESET vector
+    buff[0] = 0x7f;
+    buff[1] = 0xce; // rjmp 0x1d00 instruction
+  }
+#endif
+
+  // Copy buffer into programming buffer
+  bufPtr = buff;
+  addrPtr = (uint16_t)(void*)address;
+  ch = SPM_PAGESIZE / 2;
+  do {
+    uint16_t a;
+    a = *bufPtr++;
+    a |= (*bufPtr++) << 8;
+    __boot_page_fill_short((uint16_t)(void*)addrPtr,a);
+    addrPtr += 2;
+  } while (--ch);
+
+  // Write from programming buffer
+#ifdef RADIO_FLOW
+  radio_drain();
+#endif
+  __boot_page_write_short((uint16_t)(void*)address);
+  spm_busy_wait();
+
+#if defined(RWWSRE)
+  // Reenable read access to flash
+  boot_rww_enable();
+#endif
+#ifdef RESUME
+  journal_page(page_number(address));
+#endif
 }
 
+#ifdef SUPPORT_EEPROM
+/*
+ * Receive length bytes (0 means 256) for the EEPROM at address, writing
+ * them while the rest arrives as far as the EEPROM keeps up.
+ */
+static void prog_eeprom(uint16_t address, uint8_t length) {
+  uint8_t *bufPtr = buff, *wrPtr = buff;
+
+  do {
+    *bufPtr++ = getch();
+    if (eeprom_is_ready())
+      eeprom_write(address++, *wrPtr++);
+  } while (--length);
+
+  // Read command terminator, start reply
+  verifySpace();
+
+  while (wrPtr != bufPtr) {
+    watchdogReset();
+    eeprom_write(address++, *wrPtr++);
+  }
+}
+#endif
+
 /* main program starts here */
 int main(void) {
   uint8_t ch;
@@ -450,6 +1247,9 @@ int main(void) {
    */
   register uint16_t address = 0;
   register uint8_t  length;
+#if FLASHEND > 0x1ffff
+  uint8_t extAddress = 0;	// RAMPZ bits 1+ from LOAD EXTENDED ADDRESS
+#endif
 
   // After the zero init loop, this is the first code to run.
   //
@@ -474,17 +1274,43 @@ int main(void) {
    * still use the watchdog to reset the bootloader too.
    */
 #ifdef FORCE_WATCHDOG
-  SP = RAMEND - 32;
 #define reset_cause (*(uint8_t *) (RAMEND - 16 - 4))
 #define marker (*(uint32_t *) (RAMEND - 16 - 3))
+#endif
+#if defined(FORCE_WATCHDOG) || defined(RADIO_API) || defined(RADIO_HANDOFF) || \
+    defined(RADIO_ENTER)
+  // Keep the stack off the markers, radio handoff and driver state
+  SP = RAMEND - 32;
 
   /* GCC does loads Y with SP at the beginning, repeat it with the new SP */
   asm volatile ("in r28, 0x3d");
   asm volatile ("in r29, 0x3e");
+#endif
+
+#ifdef STAGED_UPDATE
+  // Install a staged image before anything else gets to run
+  stage_install();
+#endif
 
   ch = MCUSR;
   MCUSR = 0;
-  if ((ch & _BV(WDRF)) && marker == 0xdeadbeef) {
+  // RAM is random after anything but a watchdog reset
+#ifdef RADIO_ENTER
+  if (!(ch & _BV(WDRF)))
+    enter_req.magic = 0;
+#endif
+#ifdef RADIO_HANDOFF
+  // Only wait_timeout() sets it, and appStart() clears it once passed on
+  if (!(ch & _BV(WDRF)))
+    handoff.magic = 0;
+#endif
+#ifdef FORCE_WATCHDOG
+  if ((ch & _BV(WDRF)) && marker == 0xdeadbeef
+#ifdef IMAGE_CRC
+      // A bad image stays in the bootloader, listening
+      && image_ok()
+#endif
+      ) {
     marker = 0;
     appStart(reset_cause);
   }
@@ -493,26 +1319,49 @@ int main(void) {
   marker = 0xdeadbeef;
 #else
   // Adaboot no-wait mod
-  ch = MCUSR;
-  MCUSR = 0;
-  if (ch & (_BV(WDRF) | _BV(PORF) | _BV(BORF)))
+  if ((ch & (_BV(WDRF) | _BV(PORF) | _BV(BORF)))
+#ifdef RADIO_ENTER
+      && !entered_by_app()
+#endif
+#ifdef IMAGE_CRC
+      // A bad image stays in the bootloader, listening
+      && image_ok()
+#endif
+      )
     appStart(ch);
 #endif
 
 #if BSS_SIZE > 0
-  // Prepare .data
+  /*
+   * Prepare .data.  Over 64kB its initial values are up in the last bank
+   * with the rest of the bootloader, read them with elpm and RAMPZ.
+   */
   asm volatile (
+#if FLASHEND > 0xffff
+	"	ldi	r17, hh8(__data_load_start)\n"
+	"	out	%[rampz], r17\n"
+#endif
 	"	ldi	r17, hi8(__data_end)\n"
 	"	ldi	r26, lo8(__data_start)\n"
 	"	ldi	r27, hi8(__data_start)\n"
 	"	ldi	r30, lo8(__data_load_start)\n"
 	"	ldi	r31, hi8(__data_load_start)\n"
 	"	rjmp	cpchk\n"
+#if FLASHEND > 0xffff
+	"copy:	elpm	__tmp_reg__, Z+\n"
+#else
 	"copy:	lpm	__tmp_reg__, Z+\n"
+#endif
 	"	st	X+, __tmp_reg__\n"
 	"cpchk:	cpi	r26, lo8(__data_end)\n"
 	"	cpc	r27, r17\n"
+#if FLASHEND > 0xffff
+	"	brne	copy\n"
+	"	out	%[rampz], __zero_reg__\n"
+	:: [rampz] "I" (_SFR_IO_ADDR(RAMPZ)));
+#else
 	"	brne	copy\n");
+#endif
   // Prepare .bss
   asm volatile (
 	"	ldi	r17, hi8(__bss_end)\n"
@@ -553,8 +1402,14 @@ int main(void) {
   radio_init();
 #endif
 
-  // Set up watchdog to trigger after 500ms
-  watchdogConfig(WATCHDOG_1S);
+#ifdef RADIO_ENTER
+  // The flasher is already waiting, give it more time if the link is bad
+  if (entered_by_app())
+    watchdogConfig(WATCHDOG_ENTER);
+  else
+#endif
+  // Set up watchdog for the entry window (TIMEOUT_MS)
+  watchdogConfig(WATCHDOG_BOOT);
 
 #if (LED_START_FLASHES > 0) || defined(LED_DATA_FLASH)
   /* Set LED pin as output */
@@ -568,14 +1423,40 @@ int main(void) {
 
 #if LED_START_FLASHES > 0
   /* Flash onboard LED to signal entering of bootloader */
+#ifdef RADIO_ENTER
+  if (!entered_by_app())
+#endif
   flash_led(LED_START_FLASHES * 2);
 #endif
 
+#ifdef RADIO_ENTER
+  enter_req.magic = 0;
+#endif
+
+#ifdef LOW_POWER
+  radio_listen();
+#endif
+
   /* Forever loop */
   for (;;) {
     /* get character from UART */
     ch = getch();
 
+#ifdef QUIET
+    // Writes are only answered every quiet_every commands, if at all
+    quiet_now = 0;
+    if (quiet_every && (ch == STK_LOAD_ADDRESS || ch == STK_PROG_PAGE ||
+#ifdef PAGE_AT
+        ch == STK_PROG_PAGE_AT ||
+#endif
+        ch == STK_SET_DEVICE || ch == STK_SET_DEVICE_EXT)) {
+      if (++quiet_count < quiet_every)
+        quiet_now = 1;
+      else
+        quiet_count = 0;
+    }
+#endif
+
     if(ch == STK_GET_PARAMETER) {
       unsigned char which = getch();
       verifySpace();
@@ -594,6 +1475,13 @@ int main(void) {
 	putch(0x03);
       }
     }
+#if WATCHDOG_BOOT != WATCHDOG_SESSION
+    else if(ch == STK_GET_SYNC) {
+      verifySpace();
+      // A programmer is talking to us, switch to the session timeout
+      watchdogConfig(WATCHDOG_SESSION);
+    }
+#endif
     else if(ch == STK_SET_DEVICE) {
       // SET DEVICE is ignored
       getNch(20);
@@ -602,115 +1490,102 @@ int main(void) {
       // SET DEVICE EXT is ignored
       getNch(5);
     }
-    else if(ch == STK_LOAD_ADDRESS) {
+    else if(ch == STK_LOAD_ADDRESS
+#ifdef PAGE_AT
+            || ch == STK_PROG_PAGE_AT
+#endif
+           ) {
       // LOAD ADDRESS
       uint16_t newAddress;
       newAddress = getch();
       newAddress |= getch() << 8;
-#ifdef RAMPZ
+#if FLASHEND > 0x1ffff
+      // Transfer top bit to RAMPZ, on top of the extended address bits.
+      // RAMPZ itself may have been moved on by elpm Z+ since.
+      RAMPZ = extAddress | (newAddress >> 15);
+#elif defined(RAMPZ)
       // Transfer top bit to RAMPZ
-      RAMPZ = (newAddress & 0x8000) ? 1 : 0;
+      RAMPZ = newAddress >> 15;
 #endif
       newAddress <<= 1; // Convert from word address to byte address
       address = newAddress;
+#ifdef PAGE_AT
+      if (ch == STK_PROG_PAGE_AT) {
+        // ... followed by a number of whole flash pages to write there
+        uint32_t end;
+
+        length = getch();
+#ifdef RAMPZ
+        end = ((uint32_t) RAMPZ << 16) | address;
+#else
+        end = address;
+#endif
+        end += (uint32_t) length * SPM_PAGESIZE;
+        if (!length || end > boot_start()) {
+          // Malformed, the data can't be skipped reliably either
+          putch(STK_NOSYNC);
+          wait_timeout();
+        }
+        do {
+          prog_flash(address, (uint8_t) SPM_PAGESIZE, length == 1);
+          address += SPM_PAGESIZE;
+#ifdef RAMPZ
+          if (!address)
+            RAMPZ++;
+#endif
+        } while (--length);
+      } else
+#endif
       verifySpace();
     }
     else if(ch == STK_UNIVERSAL) {
+#if (defined(RAMPZ) && FLASHEND > 0x1ffff) || defined(CHIP_ERASE)
+      ch = getch();
+      length = getch();
+#if defined(RAMPZ) && FLASHEND > 0x1ffff
+      // Above 128kB avrdude sends LOAD EXTENDED ADDRESS (0x4d 0x00 ext 0x00)
+      // through UNIVERSAL, ext is bit 17 and up of the byte address.
+      if (ch == AVR_OP_LOAD_EXT_ADDR) {
+        extAddress = getch() << 1;
+        RAMPZ = (RAMPZ & 0x01) | extAddress;
+        getNch(1);
+      } else
+#endif
+      {
+        getNch(2);
+#ifdef CHIP_ERASE
+        // avrdude -e sends the ISP Chip Erase instruction (0xac 0x80 0 0)
+        if (ch == AVR_OP_CHIP_ERASE && length == 0x80)
+          chip_erase();
+#endif
+      }
+#else
       // UNIVERSAL command is ignored
       getNch(4);
+#endif
       putch(0x00);
     }
+#ifdef CHIP_ERASE
+    else if (ch == STK_CHIP_ERASE) {
+      verifySpace();
+      chip_erase();
+    }
+#endif
     /* Write memory, length is big endian and is in bytes */
     else if(ch == STK_PROG_PAGE) {
       // PROGRAM PAGE - we support flash and EEPROM programming
-      uint8_t *bufPtr;
-      uint16_t addrPtr;
       uint8_t type;
 
-      getch();			/* getlen() */
-      length = getch();
+      getch();			/* length high byte, 1 with 256-byte pages */
+      length = getch();		/* ... and then this is 0 */
       type = getch();
 
 #ifdef SUPPORT_EEPROM
-      if (type == 'F')		/* Flash */
-#endif
-        // If we are in RWW section, immediately start page erase
-        if (address < NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
-
-      // While that is going on, read in page contents
-      bufPtr = buff;
-      do *bufPtr++ = getch();
-      while (--length);
-
-#ifdef SUPPORT_EEPROM
-      if (type == 'F') {	/* Flash */
-#endif
-        // If we are in NRWW section, page erase has to be delayed until now.
-        // Todo: Take RAMPZ into account (not doing so just means that we will
-        //  treat the top of both "pages" of flash as NRWW, for a slight speed
-        //  decrease, so fixing this is not urgent.)
-        if (address >= NRWWSTART) __boot_page_erase_short((uint16_t)(void*)address);
-
-        // Read command terminator, start reply
-        verifySpace();
-
-        // If only a partial page is to be programmed, the erase might not be complete.
-        // So check that here
-        boot_spm_busy_wait();
-
-#ifdef VIRTUAL_BOOT_PARTITION
-        if ((uint16_t)(void*)address == 0) {
-          // This is the reset vector page. We need to live-patch the code so the
-          // bootloader runs.
-          //
-          // Move RESET vector to WDT vector
-          uint16_t vect = buff[0] | (buff[1]<<8);
-          rstVect = vect;
-          wdtVect = buff[8] | (buff[9]<<8);
-          vect -= 4; // Instruction is a relative jump (rjmp), so recalculate.
-          buff[8] = vect & 0xff;
-          buff[9] = vect >> 8;
-
-          // Add jump to bootloader at RESET vector
-          buff[0] = 0x7f;
-          buff[1] = 0xce; // rjmp 0x1d00 instruction
-        }
-#endif
-
-        // Copy buffer into programming buffer
-        bufPtr = buff;
-        addrPtr = (uint16_t)(void*)address;
-        ch = SPM_PAGESIZE / 2;
-        do {
-          uint16_t a;
-          a = *bufPtr++;
-          a |= (*bufPtr++) << 8;
-          __boot_page_fill_short((uint16_t)(void*)addrPtr,a);
-          addrPtr += 2;
-        } while (--ch);
-
-        // Write from programming buffer
-        __boot_page_write_short((uint16_t)(void*)address);
-        boot_spm_busy_wait();
-
-#if defined(RWWSRE)
-        // Reenable read access to flash
-        boot_rww_enable();
-#endif
-#ifdef SUPPORT_EEPROM
-      } else if (type == 'E') {	/* EEPROM */
-        // Read command terminator, start reply
-        verifySpace();
-
-        length = bufPtr - buff;
-        addrPtr = address;
-        bufPtr = buff;
-        while (length--) {
-          watchdogReset();
-          eeprom_write(addrPtr++, *bufPtr++);
-        }
-      }
+      if (type == 'E')		/* EEPROM */
+        prog_eeprom(address, length);
+      else
 #endif
+        prog_flash(address, length, 1);
     }
     /* Read memory block mode, length is big endian.  */
     else if(ch == STK_READ_PAGE) {
@@ -750,8 +1625,8 @@ int main(void) {
         } while (--length);
 #ifdef SUPPORT_EEPROM
       else if (type == 'E')
-        while (length--)
-          putch(eeprom_read(address++));
+        do putch(eeprom_read(address++));
+        while (--length);
 #endif
     }
 
@@ -763,7 +1638,46 @@ int main(void) {
       putch(SIGNATURE_1);
       putch(SIGNATURE_2);
     }
+#ifdef IMAGE_CRC
+    else if (ch == STK_SET_IMAGE) {
+      // SET IMAGE: pages (16 bit) and CRC-32 of the image, LSB first
+      for (length = 1; length < 7; length++)
+        buff[length] = getch();
+      verifySpace();
+      // Status last, so a half written record is never checked
+      eeprom_write(EE_IMAGE, 0xff);
+      for (length = 1; length < 7; length++)
+        eeprom_write(EE_IMAGE + length, buff[length]);
+      eeprom_write(EE_IMAGE, 'P');
+      image_declared = 1;
+    }
+#endif
+#ifdef RESUME
+    else if (ch == STK_RESUME) {
+      // RESUME: 4-byte image id in, pages already written out (LSB first)
+      uint16_t pages;
+
+      for (length = 0; length < 4; length++)
+        buff[length] = getch();
+      verifySpace();
+      pages = journal_resume(buff);
+      putch(pages);
+      putch(pages >> 8);
+    }
+#endif
+#ifdef QUIET
+    else if (ch == STK_SET_QUIET) {
+      // Checkpoint interval, 0 to answer every command again
+      length = getch();
+      verifySpace();
+      quiet_every = length;
+      quiet_count = 0;
+    }
+#endif
     else if (ch == STK_LEAVE_PROGMODE) { /* 'Q' */
+#ifdef RESUME
+      journal_flush();
+#endif
       // Adaboot no-wait mod
       watchdogConfig(WATCHDOG_16MS);
       verifySpace();
@@ -772,6 +1686,9 @@ int main(void) {
       // This covers the response to commands like STK_ENTER_PROGMODE
       verifySpace();
     }
+#ifdef QUIET
+    if (!quiet_now)
+#endif
     putch(STK_OK);
   }
 }
@@ -781,7 +1698,9 @@ int main(void) {
  * Radio mode gets set the moment we receive any command over the radio chip.
  * From that point our responses will also be sent through the radio instead
  * of through the UART.  Otherwise all communication goes through the UART
- * as normal.
+ * as normal.  With RADIO_ENTER radio_mode is 2 from the start when the
+ * application asked for a radio session: responses already go to the
+ * radio but the first packet is still parsed as the header.
  *
  * TODO: require a challenge-response negotiation at least to start the
  * radio mode, for security -- the keys need to be stored in EEPROM.  Ideally
@@ -792,30 +1711,155 @@ static uint8_t radio_mode = 0;
 static uint8_t radio_present = 0;
 static uint8_t pkt_max_len = 32;
 
-#warning Make sure pin config matches hardware setup.
-#warning Here CE  = PIN9  (PORTB1)
-#warning Here CSN = PIN10 (PORTB2)
-#define CE_DDR		DDRB
-#define CE_PORT		PORTB
-#define CSN_DDR		DDRB
-#define CSN_PORT	PORTB
-#define CE_PIN		(1 << 1)
-#define CSN_PIN		(1 << 2)
-
-#include "spi.h"
+/* CE, CSN, IRQ and SPI pins come from pin_defs.h (RF_CE=, RF_CSN=, RF_IRQ=) */
+#ifdef RADIO_API
+/*
+ * The driver keeps running in the application so its state goes into the
+ * top 32 bytes of RAM, above the RADIO_ENTER request and outside of both
+ * programs' .data/.bss.  The bootloader stack starts below those bytes,
+ * the application has to move its own (see optiboot.h).
+ */
+#define NRF24_STATE (RAMEND - 10)
+#endif
 #include "nrf24.h"
 
-#define SEQN
+#ifndef SEQN
+#define SEQN 1
+#endif
+
+#if SEQN
+#define START 1
+static uint8_t rx_seqn = 0xff;
+#else
+#define START 0
+#endif
+
+/* The part of the last packet getch() hasn't returned yet */
+static uint8_t rx_len, rx_start;
+static uint8_t rx_buf[32];
+
+#ifdef RADIO_FLOW
+/*
+ * The nRF24 only holds 3 packets and stops ACKing when they're not read,
+ * so a flasher sending while we're stuck in SPM (the CPU stops entirely
+ * for NRWW pages) would burn through its retries.  Before SPM, and while
+ * waiting for it, move the packets into RAM so the FIFO has room again.
+ * getch() reads from here first.
+ */
+#define RING_PKTS 4
+static uint8_t ring_buf[RING_PKTS][32], ring_len[RING_PKTS];
+static uint8_t ring_head, ring_count;
+
+static void radio_drain(void) {
+  while (radio_present && ring_count < RING_PKTS && nrf24_rx_fifo_data()) {
+    uint8_t i = (ring_head + ring_count) % RING_PKTS;
+
+    nrf24_rx_read(ring_buf[i], &ring_len[i]);
+    ring_count++;
+  }
+}
+
+#define radio_rx_avail() (ring_count || nrf24_rx_fifo_data())
+#define ring_empty() (!ring_count)
+
+static void radio_rx_read(uint8_t *buf, uint8_t *len) {
+  uint8_t i;
+
+  if (!ring_count) {
+    nrf24_rx_read(buf, len);
+    return;
+  }
+
+  *len = ring_len[ring_head];
+  for (i = 0; i < *len; i++)
+    buf[i] = ring_buf[ring_head][i];
+  ring_head = (ring_head + 1) % RING_PKTS;
+  ring_count--;
+}
+#else
+#define radio_rx_avail() nrf24_rx_fifo_data()
+#define radio_rx_read(buf, len) nrf24_rx_read(buf, len)
+#define ring_empty() 1
+#endif
+
+#ifdef BEACON
+/*
+ * Sent once to BEACON_ADDR after the radio comes up so that a gateway
+ * listening there learns which nodes are in the bootloader and what they
+ * run, without a session with each:
+ *   'B', own address (3), signature (3), optiboot version (minor, major),
+ *   image status, CRC-32 (LSB first)
+ * The status is the IMAGE_CRC one ('P', 'V' or 'B') or 'I' for an
+ * installed staged update, with the CRC from that record.  0xff and an
+ * all-ones CRC mean the bootloader doesn't know.
+ */
+#ifndef BEACON_ADDR
+#define BEACON_ADDR { 'B', 'C', 'N' }
+#endif
+
+static void radio_beacon(uint8_t addr[3]) {
+  uint8_t pkt[14], to[3] = BEACON_ADDR, i;
+  uint16_t crc_rec = 0;
+
+  pkt[0] = 'B';
+  pkt[1] = addr[0];
+  pkt[2] = addr[1];
+  pkt[3] = addr[2];
+  pkt[4] = SIGNATURE_0;
+  pkt[5] = SIGNATURE_1;
+  pkt[6] = SIGNATURE_2;
+  pkt[7] = OPTIBOOT_MINVER;
+  pkt[8] = OPTIBOOT_MAJVER;
+  pkt[9] = 0xff;
+#ifdef IMAGE_CRC
+  pkt[9] = eeprom_read(EE_IMAGE);
+  crc_rec = EE_IMAGE + 3;
+#endif
+#ifdef STAGED_UPDATE
+  if (pkt[9] == 0xff && eeprom_read(EE_STAGE) == 'I') {
+    pkt[9] = 'I';
+    crc_rec = EE_STAGE + 4;
+  }
+#endif
+  for (i = 0; i < 4; i++)
+    pkt[10 + i] = pkt[9] == 0xff ? 0xff : eeprom_read(crc_rec + i);
+
+  nrf24_set_tx_addr(to);
+  // One shot: without a gateway the 15 retries would eat into TIMEOUT_MS
+  nrf24_write_reg(SETUP_RETR, 0x00);
+  nrf24_tx(pkt, sizeof(pkt));
+  nrf24_tx_result_wait();
+  nrf24_write_reg(SETUP_RETR, 0x7f);
+}
+#endif
 
 static void radio_init(void) {
+#ifdef RADIO_HANDOFF
+  uint8_t *addr = handoff.addr;
+
+  handoff.present = 0;
+  handoff.channel = NRF24_CHANNEL;
+  handoff.rf_setup = NRF24_RF_SETUP;
+#else
   uint8_t addr[3];
+#endif
 
   spi_init();
 
+#ifdef RADIO_ENTER
+  // The application was using the radio a moment ago, no need to wait
+  if (!entered_by_app())
+    nrf24_delay();
+  if (nrf24_setup())
+#else
   if (nrf24_init())
+#endif
     return;
 
   radio_present = 1;
+#ifdef RADIO_HANDOFF
+  handoff.present = 1;
+#endif
   /*
    * Set our own address.
    *
@@ -836,8 +1880,138 @@ static void radio_init(void) {
   addr[2] = eeprom_read(2);
   nrf24_set_rx_addr(addr);
 
+#ifdef BEACON
+#ifdef RADIO_ENTER
+  // The flasher knows we're here already
+  if (!entered_by_app())
+#endif
+    radio_beacon(addr);
+#endif
+
+#ifdef RADIO_ENTER
+  if (entered_by_app()) {
+    /* Answer over the radio from the start, header packet still expected */
+    nrf24_set_tx_addr(enter_req.peer);
+    radio_mode = 2;
+  }
+#endif
+
   nrf24_rx_mode();
 }
+
+#ifdef LOW_POWER
+#if !defined(WDIE) || !defined(SMCR)
+#error LOW_POWER needs the watchdog interrupt and SMCR
+#endif
+/*
+ * Low-power listening for battery nodes.  Instead of leaving the radio in
+ * Rx for the whole entry window, open short Rx windows and keep the radio
+ * in Standby-I and the MCU in Power-down between them.  The watchdog runs
+ * in interrupt mode to wake us up, with interrupts disabled the MCU just
+ * continues after the sleep instruction (there is no vector table here).
+ * The flasher has to keep resending its first packet for longer than
+ * LOW_POWER_PERIOD to hit a window.  The UART is only checked during the
+ * windows.
+ */
+#define LOW_POWER_SLEEP  (_BV(WDIF) | _BV(WDIE) | _BV(WDP1))	/* 64ms */
+#define LOW_POWER_PERIOD 70					/* ms */
+#ifdef TIMEOUT_MS
+#define LOW_POWER_CYCLES ((TIMEOUT_MS + LOW_POWER_PERIOD - 1) / LOW_POWER_PERIOD)
+#else
+#define LOW_POWER_CYCLES (1000 / LOW_POWER_PERIOD)
+#endif
+#if LOW_POWER_CYCLES > 255
+#error TIMEOUT_MS too long for LOW_POWER
+#endif
+
+static void radio_listen(void) {
+  uint8_t cycles = LOW_POWER_CYCLES;
+
+  // Already talking to the flasher, or nothing to listen on
+  if (!radio_present || radio_mode)
+    return;
+
+  while (1) {
+    nrf24_rx_mode();
+    my_delay(5000);
+    if (nrf24_rx_fifo_data() || (UART_SRA & _BV(RXC0)))
+      break;
+    if (!--cycles)
+      wait_timeout();
+    nrf24_idle_mode(1);
+
+    watchdogConfig(LOW_POWER_SLEEP);
+    watchdogReset();
+    SMCR = _BV(SM1) | _BV(SE);	// Power-down
+    __asm__ __volatile__ ("sleep\n");
+    SMCR = 0;
+  }
+
+  // Someone is there, back to the normal timeout (and watchdog reset mode)
+  watchdogConfig(WATCHDOG_SESSION);
+}
+#endif
+#endif
+
+/*
+ * Functions the application may call live in a jump table in the
+ * .jumptable section, which the Makefile places 64 bytes below the end
+ * of flash (just under .version).  The first word is the table layout
+ * version, then one jmp per entry.  The layout is the same whatever was
+ * built in, entries for features that are not point at a stub returning
+ * 1.  See optiboot.h for the app side.
+ */
+#if (defined(STAGED_UPDATE) && !defined(SPI_FLASH)) || defined(RADIO_API)
+#define OPTIBOOT_API_VERSION 3
+
+#ifdef RADIO_API
+#ifndef RADIO_UART
+#error RADIO_API needs RADIO_UART
+#endif
+#define API_RADIO(f) #f
+#else
+#define API_RADIO(f) "optiboot_api_none"
+#endif
+#if defined(STAGED_UPDATE) && !defined(SPI_FLASH)
+#define API_STAGE(f) #f
+#else
+#define API_STAGE(f) "optiboot_api_none"
+#endif
+
+#define API_STR(a) MAKESTR(a)
+
+/*
+ * Every entry is 4 bytes.  The table is always within rjmp range of the
+ * bootloader code, and a jmp would be shortened by linker relaxation,
+ * moving all the entries after it.
+ */
+#define API_JMP(f) "  rjmp " f "\n  nop\n"
+
+asm("  .section .jumptable,\"ax\",@progbits\n"
+    "optiboot_api_version:  .word " API_STR(OPTIBOOT_API_VERSION) "\n"
+    API_JMP(API_STAGE(stage_write_page))
+    API_JMP(API_RADIO(spi_init))
+    API_JMP(API_RADIO(spi_transfer))
+    API_JMP(API_RADIO(nrf24_init))
+    API_JMP(API_RADIO(nrf24_read_reg))
+    API_JMP(API_RADIO(nrf24_write_reg_app))
+    API_JMP(API_RADIO(nrf24_set_rx_addr))
+    API_JMP(API_RADIO(nrf24_set_tx_addr))
+    API_JMP(API_RADIO(nrf24_rx_mode))
+    API_JMP(API_RADIO(nrf24_idle_mode))
+    API_JMP(API_RADIO(nrf24_rx_fifo_data))
+    API_JMP(API_RADIO(nrf24_rx_read))
+    API_JMP(API_RADIO(nrf24_tx))
+    API_JMP(API_RADIO(nrf24_tx_result_wait))
+    API_JMP(API_RADIO(nrf24_set_rx_pipes))
+    "  .section .text\n"
+#if !defined(RADIO_API) || !defined(STAGED_UPDATE) || defined(SPI_FLASH)
+    "optiboot_api_none:\n"
+    "  ldi r24, 1\n"
+    "  clr r25\n"
+    "  ret\n"
+#endif
+    );
 #endif
 
 void putch(char ch) {
@@ -848,8 +2022,12 @@ void putch(char ch) {
 
     pkt_buf[pkt_len++] = ch;
 
+#if defined(QUIET) || defined(PAGE_AT)
+    if (ch == STK_OK || ch == STK_NOSYNC || pkt_len == pkt_max_len) {
+#else
     if (ch == STK_OK || pkt_len == pkt_max_len) {
-#ifdef SEQN
+#endif
+#if SEQN
       uint8_t cnt = 128;
 
       while (--cnt) {
@@ -917,10 +2095,6 @@ void putch(char ch) {
 
 uint8_t getch(void) {
   uint8_t ch;
-#ifdef RADIO_UART
-  static uint8_t pkt_len = 0, pkt_start = 0;
-  static uint8_t pkt_buf[32];
-#endif
 
 #ifdef LED_DATA_FLASH
 #if defined(__AVR_ATmega8__) || defined (__AVR_ATmega32__)
@@ -974,49 +2148,43 @@ uint8_t getch(void) {
     }
 
 #ifdef RADIO_UART
-    if (radio_present && (pkt_len || nrf24_rx_fifo_data())) {
+    if (radio_present && (rx_len || radio_rx_avail())) {
       watchdogReset();
 
-      if (!pkt_len) {
-#ifdef SEQN
-        static uint8_t seqn = 0xff;
-#define START 1
-#else
-#define START 0
-#endif
-        nrf24_rx_read(pkt_buf, &pkt_len);
-        pkt_start = START;
+      if (!rx_len) {
+        radio_rx_read(rx_buf, &rx_len);
+        rx_start = START;
 
-        if (!radio_mode && pkt_len >= 4) {
+        if (radio_mode != 1 && rx_len >= 4) {
           /*
            * If this is the first packet we receive, the first three bytes
            * should contain the sender's address.
            */
-          nrf24_set_tx_addr(pkt_buf);
-          pkt_max_len = pkt_buf[3];
-          pkt_len -= 4;
-          pkt_start += 4;
+          nrf24_set_tx_addr(rx_buf);
+          pkt_max_len = rx_buf[3];
+          rx_len -= 4;
+          rx_start += 4;
 
           radio_mode = 1;
-        } else if (!radio_mode)
-          pkt_len = 0;
+        } else if (radio_mode != 1)
+          rx_len = 0;
 
-        if (!pkt_len)
+        if (!rx_len)
           continue;
 
-#ifdef SEQN
-        if (pkt_buf[0] == seqn) {
-          pkt_len = 0;
+#if SEQN
+        if (rx_buf[0] == rx_seqn) {
+          rx_len = 0;
           continue;
         }
 
-        seqn = pkt_buf[0];
-        pkt_len--;
+        rx_seqn = rx_buf[0];
+        rx_len--;
 #endif
       }
 
-      ch = pkt_buf[pkt_start ++];
-      pkt_len --;
+      ch = rx_buf[rx_start ++];
+      rx_len --;
       break;
     }
 #endif
@@ -1034,6 +2202,48 @@ uint8_t getch(void) {
   return ch;
 }
 
+/*
+ * getch() length times (0 means 256) into buf.  Radio packets that fit
+ * entirely go from the nRF24 straight into buf in one SPI burst instead
+ * of being copied through rx_buf a getch() call at a time.
+ */
+static void getbuf(uint8_t *buf, uint8_t length) {
+  uint16_t left = length ? length : 256;
+#ifdef RADIO_UART
+  uint8_t n;
+#endif
+
+  do {
+#ifdef RADIO_UART
+    if (radio_mode == 1 && !rx_len && ring_empty() && nrf24_rx_fifo_data() &&
+        (n = nrf24_rx_data_avail()) > START && n - START <= left) {
+      watchdogReset();
+      nrf24_rx_begin();
+#if SEQN
+      uint8_t seqn = spi_transfer(0);
+
+      n--;
+      if (seqn == rx_seqn) {
+        // A retransmission, skip it
+        while (n--)
+          spi_transfer(0);
+        nrf24_rx_end();
+        continue;
+      }
+      rx_seqn = seqn;
+#endif
+      nrf24_rx_burst(buf, n);
+      nrf24_rx_end();
+      buf += n;
+      left -= n;
+      continue;
+    }
+#endif
+    *buf++ = getch();
+    left--;
+  } while (left);
+}
+
 #ifdef SOFT_UART
 // AVR305 equation: #define UART_B_VALUE (((F_CPU/BAUD_RATE)-23)/6)
 // Adding 3 to numerator simulates nearest rounding for more accurate baud rates
@@ -1054,12 +2264,19 @@ void uartDelay() {
 #endif
 
 void getNch(uint8_t count) {
-  do getch(); while (--count);
+  // The bytes are ignored, buff is free between commands
+  getbuf(buff, count);
   verifySpace();
 }
 
 void wait_timeout(void) {
-#ifdef RADIO_UART
+#ifdef RESUME
+  journal_flush();
+#endif
+#ifdef RADIO_HANDOFF
+  nrf24_idle_mode(1);		      // Standby, the app takes it from here
+  handoff.magic = HANDOFF_MAGIC;
+#elif defined(RADIO_UART)
   nrf24_idle_mode(0);		      // power the radio off
 #endif
   watchdogConfig(WATCHDOG_16MS);      // shorten WD timeout
@@ -1068,8 +2285,17 @@ void wait_timeout(void) {
 }
 
 void verifySpace(void) {
-  if (getch() != CRC_EOP)
+  if (getch() != CRC_EOP) {
+#ifdef QUIET
+    // The host isn't waiting for a reply, tell it something went wrong
+    if (quiet_every)
+      putch(STK_NOSYNC);
+#endif
     wait_timeout();
+  }
+#ifdef QUIET
+  if (!quiet_now)
+#endif
   putch(STK_INSYNC);
 }
 
@@ -1113,6 +2339,17 @@ void appStart(uint8_t rstFlags) {
   //  executes before normal c init code) to save R2 to a global variable.
   __asm__ __volatile__ ("mov r2, %0\n" :: "r" (rstFlags));
 
+#ifdef RADIO_HANDOFF
+  // and whether the radio was left configured in R3
+  __asm__ __volatile__ ("mov r3, %0\n" :: "r" (handoff.magic));
+  handoff.magic = 0;
+#endif
+
+#ifdef EIND
+  // GCC expects EIND to be 0 for the application's own eicall/eijmp
+  EIND = 0;
+#endif
+
   __asm__ __volatile__ (
 #ifdef VIRTUAL_BOOT_PARTITION
     // Jump to WDT vector
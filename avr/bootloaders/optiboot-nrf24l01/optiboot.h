@@ -0,0 +1,547 @@
+/*
+ * optiboot.h - application side of the optiboot jump table.
+ *
+ * Include this in an application (not in the bootloader) to call the
+ * functions the bootloader exports.  The table sits 64 bytes below the
+ * end of flash, just under the optiboot version word:
+ *
+ *   FLASHEND+1-0x40:  table layout version (16 bit)
+ *   FLASHEND+1-0x3e:  entry 0
+ *   FLASHEND+1-0x3a:  entry 1
+ *   ...
+ *
+ * Check optiboot_api_version() before calling anything, older
+ * bootloaders don't have the table at all (the word reads 0xffff or
+ * bootloader code).  All entries of the layout are always present, the
+ * ones for features the bootloader was built without return 1.
+ */
+#ifndef _OPTIBOOT_H_
+#define _OPTIBOOT_H_
+
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+
+#define OPTIBOOT_TABLE		((uint32_t) FLASHEND + 1 - 0x40)
+#define OPTIBOOT_API_VERSION	3
+
+/* Entry n as a function pointer, ie. a word address */
+#define OPTIBOOT_ENTRY(n)	((uint16_t) ((OPTIBOOT_TABLE + 2 + 4 * (n)) >> 1))
+#define OPTIBOOT_FN(n, ret, args)	((ret (*) args) OPTIBOOT_ENTRY(n))
+
+/*
+ * Above 128kB the table is out of reach of a 16-bit function pointer so
+ * EIND has to point at it for the duration of the call.  GCC expects EIND
+ * to stay zero otherwise.
+ */
+#ifdef EIND
+#define OPTIBOOT_EIND_SET()	(EIND = (uint8_t) (OPTIBOOT_TABLE >> 17))
+#define OPTIBOOT_EIND_CLEAR()	(EIND = 0)
+#else
+#define OPTIBOOT_EIND_SET()
+#define OPTIBOOT_EIND_CLEAR()
+#endif
+
+#ifdef RAMPZ
+#define optiboot_read_word(a)	pgm_read_word_far(a)
+#else
+#define optiboot_read_word(a)	pgm_read_word_near(a)
+#endif
+
+static inline uint16_t optiboot_api_version(void) {
+	return optiboot_read_word(OPTIBOOT_TABLE);
+}
+
+/*
+ * Staged (A/B) update, bootloader built with STAGED_UPDATE=1 on a part
+ * with 64kB of flash or more.
+ *
+ * The application receives the new image in its own time and writes it
+ * page by page to OPTIBOOT_STAGE_START and up using
+ * optiboot_stage_write_page() (interrupts are disabled inside for the
+ * duration of each page write).  It returns nonzero for an address
+ * outside the staging area or a page that doesn't read back as written.
+ * When the whole image is there it calls optiboot_stage_commit() with
+ * the number of pages and the standard (zlib) CRC-32 of those pages and
+ * resets through the watchdog.  The bootloader verifies the CRC and copies the pages to address 0 before
+ * starting the new application.  The image can't be larger than
+ * OPTIBOOT_STAGE_END - OPTIBOOT_STAGE_START.
+ */
+/*
+ * With SPI_FLASH=1 (parts up to 64kB) the image goes to an external SPI
+ * NOR flash instead, written by the application with its own driver,
+ * starting at the bootloader's SPI_FLASH_OFFSET (0 by default).  The
+ * commit record and CRC are the same, the image may be as large as the
+ * RWW section.  Leave the flash chip select high before resetting.
+ */
+/*
+ * Once the copy is done the record is marked OPTIBOOT_STAGE_INSTALLED,
+ * its length and CRC still describe the staged pages, which now match
+ * the running application (until something overwrites them).
+ * optiboot_stage_write_page() clears the mark.
+ */
+#define OPTIBOOT_STAGE_START	((uint32_t) (FLASHEND + 1) / 2)
+#define OPTIBOOT_STAGE_END	((uint32_t) FLASHEND + 1 - 0x2000)
+#define OPTIBOOT_EE_STAGE	(E2END - 7)
+#define OPTIBOOT_STAGE_INSTALLED	'I'
+
+/*
+ * Other EEPROM the bootloader may use at the end, below the staging
+ * record, depending on its options.  Applications should keep clear of
+ * E2END - 20 and up:
+ *   RESUME     E2END - 13 .. E2END - 8: image id (4), pages written (2)
+ *   IMAGE_CRC  E2END - 20 .. E2END - 14: status ('P' declared, 'V' good,
+ *              'B' bad), pages (2), CRC-32 (4), LSB first
+ */
+#define OPTIBOOT_EE_JOURNAL	(E2END - 13)
+#define OPTIBOOT_EE_IMAGE	(E2END - 20)
+
+#define OPTIBOOT_STAGE_WRITE_PAGE	0
+#define OPTIBOOT_SPI_INIT		1
+#define OPTIBOOT_SPI_TRANSFER		2
+#define OPTIBOOT_NRF24_INIT		3
+#define OPTIBOOT_NRF24_READ_REG		4
+#define OPTIBOOT_NRF24_WRITE_REG	5
+#define OPTIBOOT_NRF24_SET_RX_ADDR	6
+#define OPTIBOOT_NRF24_SET_TX_ADDR	7
+#define OPTIBOOT_NRF24_RX_MODE		8
+#define OPTIBOOT_NRF24_IDLE_MODE	9
+#define OPTIBOOT_NRF24_RX_FIFO_DATA	10
+#define OPTIBOOT_NRF24_RX_READ		11
+#define OPTIBOOT_NRF24_TX		12
+#define OPTIBOOT_NRF24_TX_RESULT_WAIT	13
+#define OPTIBOOT_NRF24_SET_RX_PIPES	14	/* version 3 */
+
+static inline uint8_t optiboot_stage_write_page(uint32_t addr,
+		const uint8_t *buf) {
+	uint8_t ret;
+
+	eeprom_update_byte((uint8_t *) OPTIBOOT_EE_STAGE, 0xff);
+
+	OPTIBOOT_EIND_SET();
+	ret = OPTIBOOT_FN(OPTIBOOT_STAGE_WRITE_PAGE, uint8_t,
+			(uint32_t, const uint8_t *))(addr, buf);
+	OPTIBOOT_EIND_CLEAR();
+
+	return ret;
+}
+
+static inline void optiboot_stage_commit(uint16_t pages, uint32_t crc) {
+	eeprom_update_dword((uint32_t *) (OPTIBOOT_EE_STAGE + 4), crc);
+	eeprom_update_word((uint16_t *) (OPTIBOOT_EE_STAGE + 2), pages);
+	eeprom_update_byte((uint8_t *) (OPTIBOOT_EE_STAGE + 1), 'U');
+	/* The magic goes last so a half written record is never used */
+	eeprom_update_byte((uint8_t *) OPTIBOOT_EE_STAGE, 'S');
+}
+
+/* Length and CRC of the installed staged image, 0 if there's none */
+static inline uint8_t optiboot_stage_installed(uint16_t *pages,
+		uint32_t *crc) {
+	if (eeprom_read_byte((uint8_t *) OPTIBOOT_EE_STAGE) !=
+			OPTIBOOT_STAGE_INSTALLED)
+		return 0;
+
+	*pages = eeprom_read_word((uint16_t *) (OPTIBOOT_EE_STAGE + 2));
+	*crc = eeprom_read_dword((uint32_t *) (OPTIBOOT_EE_STAGE + 4));
+	return 1;
+}
+
+/*
+ * nRF24L01+ driver, bootloader built with RADIO_API=1.  These are the
+ * nrf24.h and spi.h functions with the bootloader's pin assignments and
+ * radio settings (3-byte addresses, dynamic payloads up to 32 bytes,
+ * auto-ACK).  Call optiboot_spi_init() and optiboot_nrf24_init() first,
+ * the latter returns non-zero if no radio is connected.  Don't use them
+ * from interrupt handlers.
+ *
+ * The driver keeps its state in OPTIBOOT_RAM_RESERVED bytes at the top of
+ * RAM (which also hold the FORCE_WATCHDOG marker), so the application's
+ * stack has to start below that, e.g. for an ATmega328:
+ *
+ *   avr-gcc ... -Wl,--defsym=__stack=0x8008df
+ *
+ * ie. 0x800000 + RAMEND - OPTIBOOT_RAM_RESERVED.
+ */
+#define OPTIBOOT_RAM_RESERVED	32
+
+/*
+ * Radio handoff, bootloader built with RADIO_HANDOFF=1.  When the
+ * bootloader times out it leaves the nRF24 powered up in Standby with
+ * its configuration (channel and RF_SETUP below, 3-byte addresses,
+ * dynamic payloads, auto-ACK, own address on pipe 1) and passes
+ * OPTIBOOT_HANDOFF_MAGIC in R3, same as the reset cause in R2.  Save R3
+ * from .init0 and, if it matches, read optiboot_handoff before the stack
+ * gets there (or move the stack as described above) and skip the
+ * radio's init and power-up delay.  present == 0 means the bootloader
+ * found no radio at all.
+ */
+#define OPTIBOOT_HANDOFF_MAGIC	0x5a
+
+struct optiboot_handoff {
+	uint8_t magic;
+	uint8_t present;
+	uint8_t channel;
+	uint8_t rf_setup;
+	uint8_t addr[3];
+};
+
+#define optiboot_handoff	(*(struct optiboot_handoff *) (RAMEND - 27))
+
+/*
+ * Reboot into a radio upload session, bootloader built with
+ * RADIO_ENTER=1.  peer is the flasher's address.  The bootloader skips
+ * its start-up delays, sends to peer from the start and waits up to 8s
+ * (2s on the ATmega8) for the first command instead of 1s.
+ */
+#define OPTIBOOT_ENTER_MAGIC	0xb007
+
+struct optiboot_enter_request {
+	uint16_t magic;
+	uint8_t peer[3];
+};
+
+#define optiboot_enter_request \
+	(*(volatile struct optiboot_enter_request *) (RAMEND - 15))
+
+static inline void optiboot_enter_radio(const uint8_t peer[3])
+		__attribute__ ((noreturn));
+static inline void optiboot_enter_radio(const uint8_t peer[3]) {
+	cli();
+	optiboot_enter_request.peer[0] = peer[0];
+	optiboot_enter_request.peer[1] = peer[1];
+	optiboot_enter_request.peer[2] = peer[2];
+	optiboot_enter_request.magic = OPTIBOOT_ENTER_MAGIC;
+	wdt_enable(WDTO_15MS);
+	while (1);
+}
+
+#define OPTIBOOT_CALL(n, args, call) \
+	do { \
+		OPTIBOOT_EIND_SET(); \
+		OPTIBOOT_FN(n, void, args) call; \
+		OPTIBOOT_EIND_CLEAR(); \
+	} while (0)
+
+#define OPTIBOOT_CALL_RET(ret, n, type, args, call) \
+	do { \
+		OPTIBOOT_EIND_SET(); \
+		ret = OPTIBOOT_FN(n, type, args) call; \
+		OPTIBOOT_EIND_CLEAR(); \
+	} while (0)
+
+static inline void optiboot_spi_init(void) {
+	OPTIBOOT_CALL(OPTIBOOT_SPI_INIT, (void), ());
+}
+
+static inline uint8_t optiboot_spi_transfer(uint8_t value) {
+	uint8_t ret;
+
+	OPTIBOOT_CALL_RET(ret, OPTIBOOT_SPI_TRANSFER, uint8_t, (uint8_t),
+			(value));
+	return ret;
+}
+
+static inline int optiboot_nrf24_init(void) {
+	int ret;
+
+	OPTIBOOT_CALL_RET(ret, OPTIBOOT_NRF24_INIT, int, (void), ());
+	return ret;
+}
+
+static inline uint8_t optiboot_nrf24_read_reg(uint8_t addr) {
+	uint8_t ret;
+
+	OPTIBOOT_CALL_RET(ret, OPTIBOOT_NRF24_READ_REG, uint8_t, (uint8_t),
+			(addr));
+	return ret;
+}
+
+static inline void optiboot_nrf24_write_reg(uint8_t addr, uint8_t value) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_WRITE_REG, (uint8_t, uint8_t),
+			(addr, value));
+}
+
+static inline void optiboot_nrf24_set_rx_addr(uint8_t addr[3]) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_SET_RX_ADDR, (uint8_t *), (addr));
+}
+
+static inline void optiboot_nrf24_set_tx_addr(uint8_t addr[3]) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_SET_TX_ADDR, (uint8_t *), (addr));
+}
+
+static inline void optiboot_nrf24_rx_mode(void) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_RX_MODE, (void), ());
+}
+
+/* standby = 0 powers the chip off */
+static inline void optiboot_nrf24_idle_mode(uint8_t standby) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_IDLE_MODE, (uint8_t), (standby));
+}
+
+static inline uint8_t optiboot_nrf24_rx_fifo_data(void) {
+	uint8_t ret;
+
+	OPTIBOOT_CALL_RET(ret, OPTIBOOT_NRF24_RX_FIFO_DATA, uint8_t, (void),
+			());
+	return ret;
+}
+
+/* buf must have room for 32 bytes */
+static inline void optiboot_nrf24_rx_read(uint8_t *buf, uint8_t *len) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_RX_READ, (uint8_t *, uint8_t *),
+			(buf, len));
+}
+
+static inline void optiboot_nrf24_tx(uint8_t *buf, uint8_t len) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_TX, (uint8_t *, uint8_t), (buf, len));
+}
+
+/*
+ * Gateways: receive on pipes 2-5 too (bit n = pipe n), e.g. one upload
+ * session per pipe.  Pipe 1 has the address from set_rx_addr(), pipes
+ * 2-5 the same one with the first byte replaced, set with
+ * optiboot_nrf24_write_reg(0x0c + n - 2, byte).  Give each node the
+ * address of its own pipe in the session's header packet, the node then
+ * sends all its replies there.  Pipe 0 is kept for ACKs, so at most 5
+ * sessions.  Only the radio side is provided, the gateway application
+ * and its host protocol for interleaving the sessions are up to you.
+ */
+static inline void optiboot_nrf24_set_rx_pipes(uint8_t pipes) {
+	OPTIBOOT_CALL(OPTIBOOT_NRF24_SET_RX_PIPES, (uint8_t), (pipes));
+}
+
+/* Pipe of the packet optiboot_nrf24_rx_read() will return next */
+static inline uint8_t optiboot_nrf24_rx_pipe(void) {
+	return (optiboot_nrf24_read_reg(0x07) >> 1) & 7;
+}
+
+/* 0 when ACKed, -1 after all retries failed */
+static inline int optiboot_nrf24_tx_result_wait(void) {
+	int ret;
+
+	OPTIBOOT_CALL_RET(ret, OPTIBOOT_NRF24_TX_RESULT_WAIT, int, (void),
+			());
+	return ret;
+}
+
+
+#ifdef OPTIBOOT_RELAY
+#include <util/delay.h>
+#include "stk500.h"
+
+/*
+ * Store-and-forward relay, define OPTIBOOT_RELAY before including this
+ * file.  Needs the RADIO_API driver and, for optiboot_relay_image(), a
+ * bootloader built with STAGED_UPDATE=1 (and a read_page function with
+ * SPI_FLASH=1, see below).
+ *
+ * A node that got its application as a staged update keeps the staged
+ * copy, so the application can push the same image to a node out of the
+ * gateway's reach, doing what the flasher and avrdude would do: the
+ * downstream bootloader sees an ordinary radio upload.  Relays chain for
+ * more hops, each one knowing the address of the next (EEPROM bytes 3-5,
+ * as on the flasher, are a good place for it).  Both nodes must be the
+ * same part and only the first 128kB can be written.  Everything returns
+ * 0 on success.  The downstream node's application must reboot into the
+ * bootloader when it gets the 1-byte 0xff packet (see
+ * optiboot_enter_radio()) or be reset by hand.
+ *
+ * With SPI_FLASH=1 the staged copy is in the external flash, which only
+ * the application's own driver can read, so it has to pass a read_page
+ * function to optiboot_relay_image() reading SPI_FLASH_OFFSET + addr.
+ * The default one reads from OPTIBOOT_STAGE_START, which on those nodes
+ * is the middle of the running application.
+ */
+static struct {
+	uint8_t seqn;		/* of the next packet we send */
+	uint8_t rx_seqn;	/* of the last packet received */
+	uint8_t rx_first;	/* the node's first packet has no seqn */
+	uint8_t len;
+	uint8_t buf[32];
+} optiboot_relay_st;
+
+static uint8_t optiboot_relay_flush(void) {
+	uint8_t tries = 8;
+	int err;
+
+	if (optiboot_relay_st.len < 2)
+		return 0;
+
+	optiboot_relay_st.buf[0] = optiboot_relay_st.seqn;
+	do {
+		optiboot_nrf24_tx(optiboot_relay_st.buf,
+				optiboot_relay_st.len);
+		err = optiboot_nrf24_tx_result_wait();
+	} while (err && --tries);
+
+	optiboot_relay_st.seqn++;
+	optiboot_relay_st.len = 1;
+	return err != 0;
+}
+
+static uint8_t optiboot_relay_put(uint8_t ch) {
+	optiboot_relay_st.buf[optiboot_relay_st.len++] = ch;
+	if (optiboot_relay_st.len == sizeof(optiboot_relay_st.buf))
+		return optiboot_relay_flush();
+	return 0;
+}
+
+/* Send the command and wait up to 250ms for STK_INSYNC, STK_OK */
+static uint8_t optiboot_relay_reply(void) {
+	uint8_t buf[32], len, i, n = 0, ms = 250;
+
+	if (optiboot_relay_put(CRC_EOP) || optiboot_relay_flush())
+		return 1;
+
+	while (ms) {
+		if (!optiboot_nrf24_rx_fifo_data()) {
+			_delay_ms(1);
+			ms--;
+			continue;
+		}
+
+		optiboot_nrf24_rx_read(buf, &len);
+		if (!len)
+			continue;
+
+		i = 1;
+		if (optiboot_relay_st.rx_first) {
+			optiboot_relay_st.rx_first = 0;
+			i = 0;
+		} else if (buf[0] == optiboot_relay_st.rx_seqn)
+			continue;	/* retransmission */
+		optiboot_relay_st.rx_seqn = buf[0];
+
+		for (; i < len; i++, n++) {
+			if (buf[i] != (n ? STK_OK : STK_INSYNC))
+				return 1;
+			if (n)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint8_t optiboot_relay_begin(const uint8_t own[3],
+		const uint8_t peer[3]) {
+	uint8_t hdr[4] = { own[0], own[1], own[2], 32 };
+	uint8_t tries = 10;
+
+	optiboot_nrf24_set_rx_addr((uint8_t *) own);
+	optiboot_nrf24_set_tx_addr((uint8_t *) peer);
+	optiboot_nrf24_rx_mode();
+
+	do {
+		/* Ask the application to reboot into the bootloader */
+		hdr[3] = 0xff;
+		optiboot_nrf24_tx(hdr + 3, 1);
+		optiboot_nrf24_tx_result_wait();
+		_delay_ms(100);
+
+		hdr[3] = 32;
+		optiboot_nrf24_tx(hdr, 4);
+		if (optiboot_nrf24_tx_result_wait())
+			continue;
+
+		optiboot_relay_st.seqn = 0;
+		optiboot_relay_st.rx_first = 1;
+		optiboot_relay_st.len = 1;
+		if (!optiboot_relay_put(STK_GET_SYNC) && !optiboot_relay_reply())
+			return 0;
+
+		/* Let the bootloader time out before trying again */
+		_delay_ms(1000);
+	} while (--tries);
+
+	return 1;
+}
+
+/* Declare the image (pages, CRC-32) to a bootloader built with IMAGE_CRC */
+static uint8_t optiboot_relay_declare(uint16_t pages, uint32_t crc) {
+	uint8_t i, err;
+
+	err = optiboot_relay_put(STK_SET_IMAGE);
+	err |= optiboot_relay_put(pages);
+	err |= optiboot_relay_put(pages >> 8);
+	for (i = 0; i < 4; i++, crc >>= 8)
+		err |= optiboot_relay_put(crc);
+
+	return err || optiboot_relay_reply();
+}
+
+static uint8_t optiboot_relay_page(uint32_t addr, const uint8_t *data) {
+	uint16_t i;
+	uint8_t err;
+
+	err = optiboot_relay_put(STK_LOAD_ADDRESS);
+	err |= optiboot_relay_put(addr >> 1);
+	err |= optiboot_relay_put(addr >> 9);
+	if (err || optiboot_relay_reply())
+		return 1;
+
+	err = optiboot_relay_put(STK_PROG_PAGE);
+	err |= optiboot_relay_put(SPM_PAGESIZE >> 8);
+	err |= optiboot_relay_put(SPM_PAGESIZE & 0xff);
+	err |= optiboot_relay_put('F');
+	for (i = 0; i < SPM_PAGESIZE; i++)
+		err |= optiboot_relay_put(data[i]);
+
+	return err || optiboot_relay_reply();
+}
+
+/* Makes the downstream bootloader start the new application */
+static uint8_t optiboot_relay_end(void) {
+	return optiboot_relay_put(STK_LEAVE_PROGMODE) ||
+		optiboot_relay_reply();
+}
+
+/* Reads the staged page at offset addr into page, 0 on success */
+typedef uint8_t (*optiboot_relay_read_t)(uint32_t addr, uint8_t *page);
+
+static uint8_t optiboot_relay_read_flash(uint32_t addr, uint8_t *page) {
+	uint16_t i;
+
+	for (i = 0; i < SPM_PAGESIZE; i += 2) {
+		uint16_t w = optiboot_read_word(OPTIBOOT_STAGE_START + addr + i);
+
+		page[i] = w;
+		page[i + 1] = w >> 8;
+	}
+
+	return 0;
+}
+
+/*
+ * Push the installed staged image to peer, declaring it if asked to.
+ * read_page is 0 for the internal staging area.
+ */
+static uint8_t optiboot_relay_image(const uint8_t own[3],
+		const uint8_t peer[3], uint8_t declare,
+		optiboot_relay_read_t read_page) {
+	uint8_t page[SPM_PAGESIZE];
+	uint16_t pages, p;
+	uint32_t crc, addr;
+
+	if (!read_page)
+		read_page = optiboot_relay_read_flash;
+
+	if (!optiboot_stage_installed(&pages, &crc) ||
+			optiboot_relay_begin(own, peer))
+		return 1;
+
+	if (declare && optiboot_relay_declare(pages, crc))
+		return 1;
+
+	for (p = 0, addr = 0; p < pages; p++, addr += SPM_PAGESIZE)
+		if (read_page(addr, page) || optiboot_relay_page(addr, page))
+			return 1;
+
+	return optiboot_relay_end();
+}
+#endif
+
+#endif
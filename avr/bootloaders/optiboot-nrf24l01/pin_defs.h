@@ -16,6 +16,25 @@
 #define UART_TX_BIT 1
 #define UART_RX_BIT 0
 #endif
+
+/* Hardware SPI, default nRF24L01+ wiring (CE = pin 9, CSN = pin 10), and */
+/* SPI flash chip select (pin 8, as on Moteino) */
+#if defined(RADIO_UART) || defined(SPI_FLASH)
+#define SPI_DDR     DDRB
+#define SCK_PIN     (1 << 5)
+#define MISO_PIN    (1 << 4)
+#define MOSI_PIN    (1 << 3)
+#define SS_PIN      (1 << 2)
+#if !defined(RF_CE)
+#define RF_CE       B1
+#endif
+#if !defined(RF_CSN)
+#define RF_CSN      B2
+#endif
+#if !defined(FLASH_CS)
+#define FLASH_CS    B0
+#endif
+#endif
 #endif
 
 #if defined(__AVR_ATmega8__) || defined(__AVR_ATmega32__)
@@ -68,11 +87,26 @@
 #define UART_TX_BIT 1
 #define UART_RX_BIT 0
 #endif
+
+/* Hardware SPI, and default nRF24L01+ wiring: CE = PB3, CSN = SS (PB4) */
+#if defined(RADIO_UART) || defined(SPI_FLASH)
+#define SPI_DDR     DDRB
+#define SCK_PIN     (1 << 7)
+#define MISO_PIN    (1 << 6)
+#define MOSI_PIN    (1 << 5)
+#define SS_PIN      (1 << 4)
+#if !defined(RF_CE)
+#define RF_CE       B3
+#endif
+#if !defined(RF_CSN)
+#define RF_CSN      B4
+#endif
+#endif
 #endif
 
 /*------------------------------------------------------------------------ */
 /* Mega support */
-#if defined(__AVR_ATmega1280__)
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
 /*------------------------------------------------------------------------ */
 /* Onboard LED is connected to pin PB7 on Arduino Mega */ 
 #if !defined(LED)
@@ -87,6 +121,21 @@
 #define UART_TX_BIT 1
 #define UART_RX_BIT 0
 #endif
+
+/* Hardware SPI, and default nRF24L01+ wiring: CE = pin 10, CSN = SS (pin 53) */
+#if defined(RADIO_UART) || defined(SPI_FLASH)
+#define SPI_DDR     DDRB
+#define SCK_PIN     (1 << 1)
+#define MISO_PIN    (1 << 3)
+#define MOSI_PIN    (1 << 2)
+#define SS_PIN      (1 << 0)
+#if !defined(RF_CE)
+#define RF_CE       B4
+#endif
+#if !defined(RF_CSN)
+#define RF_CSN      B0
+#endif
+#endif
 #endif
 
 /*
@@ -740,3 +789,162 @@
 #error Unrecognized LED name.  Should be like "B5"
 #error -------------------------------------------
 #endif
+
+/*
+ * ------------------------------------------------------------------------
+ * nRF24L01+ control pins.  These use the same "B1"-style names as the LED,
+ * eg. "make atmega1284_rf RF_CE=D6 RF_CSN=D7 RF_IRQ=D2".  Only the port
+ * letter and bit number are used so the tables are indexed by port.
+ * RF_IRQ is optional; without it the RX FIFO status is polled over SPI.
+ */
+#ifdef RADIO_UART
+#if (RF_CE >> 8) == 1
+#define CE_DDR	DDRA
+#define CE_PORT	PORTA
+#elif (RF_CE >> 8) == 2
+#define CE_DDR	DDRB
+#define CE_PORT	PORTB
+#elif (RF_CE >> 8) == 3
+#define CE_DDR	DDRC
+#define CE_PORT	PORTC
+#elif (RF_CE >> 8) == 4
+#define CE_DDR	DDRD
+#define CE_PORT	PORTD
+#elif (RF_CE >> 8) == 5
+#define CE_DDR	DDRE
+#define CE_PORT	PORTE
+#elif (RF_CE >> 8) == 6
+#define CE_DDR	DDRF
+#define CE_PORT	PORTF
+#elif (RF_CE >> 8) == 7
+#define CE_DDR	DDRG
+#define CE_PORT	PORTG
+#elif (RF_CE >> 8) == 8
+#define CE_DDR	DDRH
+#define CE_PORT	PORTH
+#elif (RF_CE >> 8) == 10
+#define CE_DDR	DDRJ
+#define CE_PORT	PORTJ
+#elif (RF_CE >> 8) == 11
+#define CE_DDR	DDRK
+#define CE_PORT	PORTK
+#elif (RF_CE >> 8) == 12
+#define CE_DDR	DDRL
+#define CE_PORT	PORTL
+#else
+#error Unrecognized RF_CE name.  Should be like "B1"
+#endif
+#define CE_PIN	(1 << (RF_CE & 7))
+
+#if (RF_CSN >> 8) == 1
+#define CSN_DDR	DDRA
+#define CSN_PORT PORTA
+#elif (RF_CSN >> 8) == 2
+#define CSN_DDR	DDRB
+#define CSN_PORT PORTB
+#elif (RF_CSN >> 8) == 3
+#define CSN_DDR	DDRC
+#define CSN_PORT PORTC
+#elif (RF_CSN >> 8) == 4
+#define CSN_DDR	DDRD
+#define CSN_PORT PORTD
+#elif (RF_CSN >> 8) == 5
+#define CSN_DDR	DDRE
+#define CSN_PORT PORTE
+#elif (RF_CSN >> 8) == 6
+#define CSN_DDR	DDRF
+#define CSN_PORT PORTF
+#elif (RF_CSN >> 8) == 7
+#define CSN_DDR	DDRG
+#define CSN_PORT PORTG
+#elif (RF_CSN >> 8) == 8
+#define CSN_DDR	DDRH
+#define CSN_PORT PORTH
+#elif (RF_CSN >> 8) == 10
+#define CSN_DDR	DDRJ
+#define CSN_PORT PORTJ
+#elif (RF_CSN >> 8) == 11
+#define CSN_DDR	DDRK
+#define CSN_PORT PORTK
+#elif (RF_CSN >> 8) == 12
+#define CSN_DDR	DDRL
+#define CSN_PORT PORTL
+#else
+#error Unrecognized RF_CSN name.  Should be like "B1"
+#endif
+#define CSN_PIN	(1 << (RF_CSN & 7))
+
+#ifdef RF_IRQ
+#if (RF_IRQ >> 8) == 1
+#define IRQ_INPUT PINA
+#elif (RF_IRQ >> 8) == 2
+#define IRQ_INPUT PINB
+#elif (RF_IRQ >> 8) == 3
+#define IRQ_INPUT PINC
+#elif (RF_IRQ >> 8) == 4
+#define IRQ_INPUT PIND
+#elif (RF_IRQ >> 8) == 5
+#define IRQ_INPUT PINE
+#elif (RF_IRQ >> 8) == 6
+#define IRQ_INPUT PINF
+#elif (RF_IRQ >> 8) == 7
+#define IRQ_INPUT PING
+#elif (RF_IRQ >> 8) == 8
+#define IRQ_INPUT PINH
+#elif (RF_IRQ >> 8) == 10
+#define IRQ_INPUT PINJ
+#elif (RF_IRQ >> 8) == 11
+#define IRQ_INPUT PINK
+#elif (RF_IRQ >> 8) == 12
+#define IRQ_INPUT PINL
+#else
+#error Unrecognized RF_IRQ name.  Should be like "B1"
+#endif
+#define IRQ_PIN	(1 << (RF_IRQ & 7))
+#endif
+#endif
+
+/* SPI NOR flash chip select for SPI_FLASH staging, same naming */
+#ifdef SPI_FLASH
+#if !defined(FLASH_CS)
+#error SPI_FLASH needs FLASH_CS set to the flash chip select pin
+#endif
+#if (FLASH_CS >> 8) == 1
+#define FLASH_CS_DDR	DDRA
+#define FLASH_CS_PORT	PORTA
+#elif (FLASH_CS >> 8) == 2
+#define FLASH_CS_DDR	DDRB
+#define FLASH_CS_PORT	PORTB
+#elif (FLASH_CS >> 8) == 3
+#define FLASH_CS_DDR	DDRC
+#define FLASH_CS_PORT	PORTC
+#elif (FLASH_CS >> 8) == 4
+#define FLASH_CS_DDR	DDRD
+#define FLASH_CS_PORT	PORTD
+#elif (FLASH_CS >> 8) == 5
+#define FLASH_CS_DDR	DDRE
+#define FLASH_CS_PORT	PORTE
+#elif (FLASH_CS >> 8) == 6
+#define FLASH_CS_DDR	DDRF
+#define FLASH_CS_PORT	PORTF
+#elif (FLASH_CS >> 8) == 7
+#define FLASH_CS_DDR	DDRG
+#define FLASH_CS_PORT	PORTG
+#elif (FLASH_CS >> 8) == 8
+#define FLASH_CS_DDR	DDRH
+#define FLASH_CS_PORT	PORTH
+#elif (FLASH_CS >> 8) == 10
+#define FLASH_CS_DDR	DDRJ
+#define FLASH_CS_PORT	PORTJ
+#elif (FLASH_CS >> 8) == 11
+#define FLASH_CS_DDR	DDRK
+#define FLASH_CS_PORT	PORTK
+#elif (FLASH_CS >> 8) == 12
+#define FLASH_CS_DDR	DDRL
+#define FLASH_CS_PORT	PORTL
+#else
+#error Unrecognized FLASH_CS name.  Should be like "B0"
+#endif
+#define FLASH_CS_PIN	(1 << (FLASH_CS & 7))
+#endif
+
@@ -4,11 +4,10 @@
  * Licensed under AGPLv3.
  */
 
-#define SPI_DDR		DDRB
-#define SCK_PIN		(1 << 5)
-#define MISO_PIN	(1 << 4)
-#define MOSI_PIN	(1 << 3)
-#define SS_PIN		(1 << 2)
+/* SPI_DDR and the *_PIN masks are defined per chip in pin_defs.h */
+#ifndef SPI_DDR
+#error No hardware SPI pin definitions for this chip
+#endif
 
 static void spi_mode(uint8_t mode) {
 	/* Enable SPI master with configuration byte specified */
@@ -19,7 +18,7 @@ static void spi_mode(uint8_t mode) {
 	(void) SPDR;
 }
 
-static void spi_init(void) {
+static RADIO_EXPORT void spi_init(void) {
 	/* Initialize the SPI pins: SCK & MOSI as outputs, MISO as input */
 	SPI_DDR |= SCK_PIN | MOSI_PIN;
 	SPI_DDR &= ~MISO_PIN;
@@ -30,7 +29,7 @@ static void spi_init(void) {
 	spi_mode(0);
 }
 
-static uint8_t spi_transfer(uint8_t value) {
+static RADIO_EXPORT uint8_t spi_transfer(uint8_t value) {
 	uint8_t cnt = 0xff;
 	SPDR = value;
 	while (cnt -- && !(SPSR & (1 << SPIF)));
@@ -37,3 +37,13 @@
 #define STK_READ_OSCCAL     0x76  // 'v'
 #define STK_READ_FUSE_EXT   0x77  // 'w'
 #define STK_READ_OSCCAL_EXT 0x78  // 'x'
+
+/* STK_UNIVERSAL sub-commands */
+#define AVR_OP_LOAD_EXT_ADDR 0x4d
+#define AVR_OP_CHIP_ERASE    0xac  // 0xac 0x80 0x00 0x00
+
+/* Optiboot extensions */
+#define STK_RESUME          0x5a  // 'Z' image id (4) -> pages written (2)
+#define STK_SET_IMAGE       0x5b  // '[' pages (2), CRC-32 (4)
+#define STK_SET_QUIET       0x5c  // '\\' reply to writes every n (1), 0 = always
+#define STK_PROG_PAGE_AT    0x5d  // ']' word address (2), pages (1), data